@@ -0,0 +1,706 @@
+/*
+Description: Reproducible benchmark of the ikd-Tree operations on seeded synthetic scenes
+             and on recorded LiDAR scans (KITTI .bin format).
+             Every case prints one JSON line (or CSV row) with ns/op and latency percentiles.
+
+Usage: ikd_tree_benchmark [--seed N] [--points N] [--queries N] [--scene uniform|planar|corridor|sliding|all]
+                          [--format json|csv] [--output file] [--scan frame_0.bin frame_1.bin ...]
+*/
+#include "ikd_Tree.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "pcl/point_types.h"
+
+using PointType = pcl::PointXYZ;
+using PointVector = KD_TREE<PointType>::PointVector;
+
+#define Default_Point_Num 200000
+#define Default_Query_Num 20000
+#define Insert_Batch_Size 1000
+#define Box_Length 1.0
+#define Delete_Box_Length 0.5
+#define Search_Radius 0.5
+#define Downsample_Size 0.2
+#define Window_Length 60.0
+#define Sensor_Range 30.0
+#define Sensor_Step 1.0
+#define Scan_Point_Num 10000
+#define Clear_Box_Length 10.0
+#define Clear_Box_Num 20
+#define Prune_Size 256
+#define Compact_Budget 20000
+
+std::mt19937 rng;
+bool csv_output = false;
+FILE *output = stdout;
+
+float rand_float(float x_min, float x_max)
+{
+    std::uniform_real_distribution<float> distribution(x_min, x_max);
+    return distribution(rng);
+}
+
+float rand_normal(float sigma)
+{
+    std::normal_distribution<float> distribution(0.0f, sigma);
+    return distribution(rng);
+}
+
+PointType make_point(float x, float y, float z)
+{
+    PointType point;
+    point.x = x;
+    point.y = y;
+    point.z = z;
+    return point;
+}
+
+/*
+    Timing and reporting
+*/
+
+struct Case_Timer
+{
+    std::vector<double> samples;
+    chrono::steady_clock::time_point start_time;
+    void start()
+    {
+        start_time = chrono::steady_clock::now();
+    }
+    void stop(int ops = 1)
+    {
+        double duration = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start_time).count();
+        samples.push_back(duration / ops);
+    }
+};
+
+void report(const std::string &scene, const std::string &name, Case_Timer &timer, int tree_size, double recall = -1.0)
+{
+    std::vector<double> &samples = timer.samples;
+    if (samples.empty())
+        return;
+    std::sort(samples.begin(), samples.end());
+    double total = 0.0;
+    for (double sample : samples)
+        total += sample;
+    auto percentile = [&](double p) { return samples[std::min(samples.size() - 1, size_t(p * samples.size()))]; };
+    if (csv_output)
+    {
+        fprintf(output, "%s,%s,%zu,%.1f,%.1f,%.1f,%.1f,%.1f,%d,", scene.c_str(), name.c_str(), samples.size(), total / samples.size(),
+               percentile(0.5), percentile(0.9), percentile(0.99), samples.back(), tree_size);
+        if (recall >= 0)
+            fprintf(output, "%.4f", recall);
+        fprintf(output, "\n");
+    }
+    else
+    {
+        fprintf(output, "{\"scene\": \"%s\", \"case\": \"%s\", \"ops\": %zu, \"ns_per_op\": %.1f, \"p50_ns\": %.1f, \"p90_ns\": %.1f, \"p99_ns\": %.1f, \"max_ns\": %.1f, \"tree_size\": %d",
+               scene.c_str(), name.c_str(), samples.size(), total / samples.size(), percentile(0.5), percentile(0.9), percentile(0.99), samples.back(), tree_size);
+        if (recall >= 0)
+            fprintf(output, ", \"recall\": %.4f", recall);
+        fprintf(output, "}\n");
+    }
+    fflush(output);
+}
+
+/*
+    Synthetic scenes
+*/
+
+void generate_uniform(int num, PointVector &cloud)
+{
+    for (int i = 0; i < num; i++)
+        cloud.push_back(make_point(rand_float(-50, 50), rand_float(-50, 50), rand_float(-5, 5)));
+}
+
+// Ground plane plus a set of vertical walls, the structure a LiDAR map is dominated by
+void generate_planar(int num, PointVector &cloud)
+{
+    const int wall_num = 20;
+    float wall_x[wall_num], wall_y[wall_num], wall_yaw[wall_num], wall_len[wall_num];
+    for (int i = 0; i < wall_num; i++)
+    {
+        wall_x[i] = rand_float(-50, 50);
+        wall_y[i] = rand_float(-50, 50);
+        wall_yaw[i] = rand_float(0, M_PI);
+        wall_len[i] = rand_float(5, 30);
+    }
+    for (int i = 0; i < num; i++)
+    {
+        if (i % 2 == 0)
+        {
+            cloud.push_back(make_point(rand_float(-50, 50), rand_float(-50, 50), rand_normal(0.02f)));
+        }
+        else
+        {
+            int k = i % wall_num;
+            float s = rand_float(-0.5f, 0.5f) * wall_len[k];
+            cloud.push_back(make_point(wall_x[k] + s * cos(wall_yaw[k]) + rand_normal(0.02f), wall_y[k] + s * sin(wall_yaw[k]) + rand_normal(0.02f), rand_float(0, 5)));
+        }
+    }
+}
+
+// A long narrow corridor along x: floor, ceiling and two side walls
+void generate_corridor(int num, PointVector &cloud)
+{
+    for (int i = 0; i < num; i++)
+    {
+        float x = rand_float(-200, 200);
+        switch (i % 4)
+        {
+        case 0:
+            cloud.push_back(make_point(x, rand_float(-1.5, 1.5), rand_normal(0.01f)));
+            break;
+        case 1:
+            cloud.push_back(make_point(x, rand_float(-1.5, 1.5), 3.0f + rand_normal(0.01f)));
+            break;
+        case 2:
+            cloud.push_back(make_point(x, -1.5f + rand_normal(0.01f), rand_float(0, 3)));
+            break;
+        default:
+            cloud.push_back(make_point(x, 1.5f + rand_normal(0.01f), rand_float(0, 3)));
+            break;
+        }
+    }
+}
+
+// One scan of a sensor at sensor_x looking at a ground plane and random walls
+void generate_scan(float sensor_x, int num, PointVector &cloud)
+{
+    for (int i = 0; i < num; i++)
+    {
+        float yaw = rand_float(-M_PI, M_PI);
+        float range = rand_float(2.0, Sensor_Range);
+        if (i % 3 == 0)
+            cloud.push_back(make_point(sensor_x + range * cos(yaw), range * sin(yaw), rand_normal(0.02f)));
+        else
+            cloud.push_back(make_point(sensor_x + range * cos(yaw), (yaw > 0 ? 8.0f : -8.0f) + rand_normal(0.02f), rand_float(0, 4)));
+    }
+}
+
+bool load_kitti_scan(const char *filename, PointVector &cloud)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (fp == nullptr)
+        return false;
+    float data[4];
+    while (fread(data, sizeof(float), 4, fp) == 4)
+        cloud.push_back(make_point(data[0], data[1], data[2]));
+    fclose(fp);
+    return true;
+}
+
+PointType query_near(const PointVector &cloud)
+{
+    const PointType &p = cloud[rng() % cloud.size()];
+    return make_point(p.x + rand_normal(0.1f), p.y + rand_normal(0.1f), p.z + rand_normal(0.1f));
+}
+
+BoxPointType box_around(const PointType &center, float length)
+{
+    BoxPointType box;
+    float d = length / 2;
+    box.vertex_min[0] = center.x - d;
+    box.vertex_max[0] = center.x + d;
+    box.vertex_min[1] = center.y - d;
+    box.vertex_max[1] = center.y + d;
+    box.vertex_min[2] = center.z - d;
+    box.vertex_max[2] = center.z + d;
+    return box;
+}
+
+// Plane fit on the output of Nearest_Search, the way registration code does it without the fused query
+bool fit_plane_points(const PointVector &points, float max_residual, float normal[3], float &d)
+{
+    Eigen::Vector3f center = Eigen::Vector3f::Zero();
+    Eigen::Matrix3f covariance = Eigen::Matrix3f::Zero();
+    for (const PointType &point : points)
+    {
+        Eigen::Vector3f p(point.x - points[0].x, point.y - points[0].y, point.z - points[0].z);
+        center += p;
+        covariance += p * p.transpose();
+    }
+    center /= points.size();
+    covariance = covariance / points.size() - center * center.transpose();
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> solver;
+    solver.computeDirect(covariance);
+    Eigen::Vector3f n = solver.eigenvectors().col(0).normalized();
+    Eigen::Vector3f origin(points[0].x, points[0].y, points[0].z);
+    d = -n.dot(center + origin);
+    for (int i = 0; i < 3; i++)
+        normal[i] = n[i];
+    for (const PointType &point : points)
+    {
+        if (fabs(n.dot(Eigen::Vector3f(point.x, point.y, point.z)) + d) > max_residual)
+            return false;
+    }
+    return true;
+}
+
+/*
+    Workloads on a static map: build, insert, searches and box delete
+*/
+
+void run_static_workloads(const std::string &scene, PointVector &cloud, int query_num)
+{
+    PointVector search_result;
+    vector<float> distances;
+    Case_Timer timer;
+    // Build
+    {
+        KD_TREE<PointType>::Ptr tree_ptr(new KD_TREE<PointType>(0.3, 0.6, Downsample_Size));
+        timer.start();
+        tree_ptr->Build(cloud);
+        timer.stop(cloud.size());
+        report(scene, "build", timer, tree_ptr->size());
+    }
+    KD_TREE<PointType>::Ptr tree_ptr(new KD_TREE<PointType>(0.3, 0.6, Downsample_Size));
+    KD_TREE<PointType> &ikd_Tree = *tree_ptr;
+    PointVector initial(cloud.begin(), cloud.begin() + cloud.size() / 2);
+    ikd_Tree.Build(initial);
+    // Incremental insertion with and without downsample
+    for (int downsample = 0; downsample < 2; downsample++)
+    {
+        Case_Timer insert_timer;
+        size_t begin = cloud.size() / 2 + downsample * cloud.size() / 4;
+        size_t end = begin + cloud.size() / 4;
+        for (size_t i = begin; i < end; i += Insert_Batch_Size)
+        {
+            PointVector batch(cloud.begin() + i, cloud.begin() + std::min(end, i + Insert_Batch_Size));
+            insert_timer.start();
+            ikd_Tree.Add_Points(batch, downsample == 1);
+            insert_timer.stop(batch.size());
+        }
+        report(scene, downsample ? "insert_downsample" : "insert", insert_timer, ikd_Tree.size());
+    }
+    // Wait for the rebuild thread so that searches run on a settled tree
+    usleep(100000);
+    // k-nearest search
+    int k_list[3] = {1, 5, 20};
+    for (int k : k_list)
+    {
+        Case_Timer knn_timer;
+        for (int i = 0; i < query_num; i++)
+        {
+            PointType target = query_near(cloud);
+            knn_timer.start();
+            ikd_Tree.Nearest_Search(target, k, search_result, distances);
+            knn_timer.stop();
+        }
+        report(scene, "knn_k" + std::to_string(k), knn_timer, ikd_Tree.size());
+    }
+    // Approximate k-nearest search: recall of the exact 5 nearest neighbors against the speed-up
+    {
+        std::vector<PointType> targets;
+        std::vector<vector<float>> exact_distances;
+        for (int i = 0; i < query_num / 4; i++)
+        {
+            targets.push_back(query_near(cloud));
+            ikd_Tree.Nearest_Search(targets.back(), 5, search_result, distances);
+            exact_distances.push_back(distances);
+        }
+        struct Approximate_Setting
+        {
+            const char *name;
+            float epsilon;
+            int max_visit;
+        };
+        Approximate_Setting settings[] = {{"knn_k5_eps0.5", 0.5f, 0}, {"knn_k5_eps1", 1.0f, 0}, {"knn_k5_eps2", 2.0f, 0},
+                                          {"knn_k5_visit64", 0.0f, 64}, {"knn_k5_visit32", 0.0f, 32}};
+        for (auto &setting : settings)
+        {
+            Case_Timer approximate_timer;
+            int hit = 0, total = 0;
+            for (size_t i = 0; i < targets.size(); i++)
+            {
+                approximate_timer.start();
+                ikd_Tree.Nearest_Search(targets[i], 5, search_result, distances, INFINITY, setting.epsilon, setting.max_visit);
+                approximate_timer.stop();
+                // A returned neighbor counts as a hit if it is no farther than the exact k-th neighbor
+                for (float dist : distances)
+                    hit += dist <= exact_distances[i].back();
+                total += exact_distances[i].size();
+            }
+            report(scene, setting.name, approximate_timer, ikd_Tree.size(), double(hit) / std::max(1, total));
+        }
+    }
+    // Tracked features: a set of points that move a little between frames, searched with and without a hint
+    {
+        const int feature_num = 1000;
+        PointVector features;
+        for (int i = 0; i < feature_num; i++)
+            features.push_back(query_near(cloud));
+        vector<KD_TREE<PointType>::Search_Hint> hints(feature_num);
+        Case_Timer tracked_timer, hint_timer;
+        for (int frame = 0; frame < std::max(1, query_num / feature_num); frame++)
+        {
+            for (PointType &feature : features)
+            {
+                feature.x += 0.02f;
+                feature.y += 0.01f;
+            }
+            // Separate passes, so that neither search runs on nodes the other one has just loaded
+            for (int i = 0; i < feature_num; i++)
+            {
+                tracked_timer.start();
+                ikd_Tree.Nearest_Search(features[i], 5, search_result, distances);
+                tracked_timer.stop();
+            }
+            for (int i = 0; i < feature_num; i++)
+            {
+                hint_timer.start();
+                ikd_Tree.Nearest_Search(features[i], 5, search_result, distances, hints[i]);
+                hint_timer.stop();
+            }
+        }
+        report(scene, "knn_k5_tracked", tracked_timer, ikd_Tree.size());
+        report(scene, "knn_k5_tracked_hint", hint_timer, ikd_Tree.size());
+    }
+    // Point-to-plane matching: k = 5 search followed by a plane fit, separately, fused and batched
+    {
+        const int batch_size = 1000;
+        Case_Timer separate_timer, fused_timer, batch_timer, lookup_timer;
+        vector<KD_TREE<PointType>::Plane_Fit> planes;
+        KD_TREE<PointType>::Plane_Fit plane;
+        for (int batch = 0; batch < std::max(1, query_num / batch_size); batch++)
+        {
+            PointVector targets;
+            for (int i = 0; i < batch_size; i++)
+                targets.push_back(query_near(cloud));
+            for (const PointType &target : targets)
+            {
+                separate_timer.start();
+                ikd_Tree.Nearest_Search(target, 5, search_result, distances);
+                if (search_result.size() == 5)
+                    fit_plane_points(search_result, 0.1f, plane.normal, plane.d);
+                separate_timer.stop();
+            }
+            for (const PointType &target : targets)
+            {
+                fused_timer.start();
+                ikd_Tree.Nearest_Plane(target, 5, plane);
+                fused_timer.stop();
+            }
+            batch_timer.start();
+            ikd_Tree.Nearest_Plane_Batch(targets, 5, planes);
+            batch_timer.stop(batch_size);
+            // From the cached moments in ikd_tree_benchmark_moments, a 10-nearest fit otherwise
+            for (const PointType &target : targets)
+            {
+                lookup_timer.start();
+                ikd_Tree.Plane_Lookup(target, 10, plane);
+                lookup_timer.stop();
+            }
+        }
+        report(scene, "plane_k5_separate", separate_timer, ikd_Tree.size());
+        report(scene, "plane_k5_fused", fused_timer, ikd_Tree.size());
+        report(scene, "plane_k5_batch", batch_timer, ikd_Tree.size());
+        report(scene, "plane_lookup", lookup_timer, ikd_Tree.size());
+    }
+    // Box and radius search
+    Case_Timer box_timer, radius_timer, radius_capped_timer;
+    for (int i = 0; i < query_num / 10; i++)
+    {
+        PointType center = query_near(cloud);
+        BoxPointType box = box_around(center, Box_Length);
+        box_timer.start();
+        ikd_Tree.Box_Search(box, search_result);
+        box_timer.stop();
+        radius_timer.start();
+        ikd_Tree.Radius_Search(center, Search_Radius, search_result);
+        radius_timer.stop();
+        radius_capped_timer.start();
+        ikd_Tree.Radius_Search(center, Search_Radius, 10, search_result, distances);
+        radius_capped_timer.stop();
+    }
+    report(scene, "box_search", box_timer, ikd_Tree.size());
+    report(scene, "radius_search", radius_timer, ikd_Tree.size());
+    report(scene, "radius_search_k10", radius_capped_timer, ikd_Tree.size());
+    // Box delete
+    Case_Timer delete_timer;
+    for (int i = 0; i < query_num / 10; i++)
+    {
+        vector<BoxPointType> boxes(1, box_around(query_near(cloud), Delete_Box_Length));
+        delete_timer.start();
+        ikd_Tree.Delete_Point_Boxes(boxes);
+        delete_timer.stop();
+    }
+    report(scene, "box_delete", delete_timer, ikd_Tree.size());
+    // Clearing large regions with and without pruning, the tree size is taken right after the deletes
+    for (int prune = 0; prune < 2; prune++)
+    {
+        KD_TREE<PointType>::Ptr clear_tree_ptr(new KD_TREE<PointType>(0.3, 0.6, Downsample_Size));
+        clear_tree_ptr->set_prune_param(prune ? Prune_Size : 0);
+        clear_tree_ptr->Build(cloud);
+        Case_Timer clear_timer, clear_knn_timer;
+        for (int i = 0; i < Clear_Box_Num; i++)
+        {
+            vector<BoxPointType> boxes(1, box_around(query_near(cloud), Clear_Box_Length));
+            clear_timer.start();
+            clear_tree_ptr->Delete_Point_Boxes(boxes);
+            clear_timer.stop();
+        }
+        int clear_size = clear_tree_ptr->size();
+        for (int i = 0; i < query_num / 10; i++)
+        {
+            PointType target = query_near(cloud);
+            clear_knn_timer.start();
+            clear_tree_ptr->Nearest_Search(target, 5, search_result, distances);
+            clear_knn_timer.stop();
+        }
+        report(scene, prune ? "clear_box_delete_prune" : "clear_box_delete", clear_timer, clear_size);
+        report(scene, prune ? "clear_knn_k5_prune" : "clear_knn_k5", clear_knn_timer, clear_size);
+    }
+    // Scattered deletes below the delete criterion stay in the tree until Compact removes them at idle time
+    {
+        KD_TREE<PointType>::Ptr compact_tree_ptr(new KD_TREE<PointType>(0.3, 0.6, Downsample_Size));
+        compact_tree_ptr->Build(cloud);
+        PointVector deleted;
+        for (size_t i = 0; i < cloud.size(); i += 4)
+            deleted.push_back(cloud[i]);
+        compact_tree_ptr->Delete_Points(deleted);
+        usleep(100000);
+        Case_Timer before_timer, compact_timer, after_timer;
+        std::vector<PointType> targets;
+        for (int i = 0; i < query_num / 10; i++)
+            targets.push_back(query_near(cloud));
+        for (const PointType &target : targets)
+        {
+            before_timer.start();
+            compact_tree_ptr->Nearest_Search(target, 5, search_result, distances);
+            before_timer.stop();
+        }
+        int tombstone_size = compact_tree_ptr->size();
+        while (true)
+        {
+            compact_timer.start();
+            int rebuilt_num = compact_tree_ptr->Compact(Compact_Budget);
+            compact_timer.stop();
+            if (rebuilt_num == 0)
+                break;
+            // Let the rebuild thread finish between calls, as it would between scans
+            usleep(10000);
+        }
+        for (const PointType &target : targets)
+        {
+            after_timer.start();
+            compact_tree_ptr->Nearest_Search(target, 5, search_result, distances);
+            after_timer.stop();
+        }
+        report(scene, "tombstone_knn_k5", before_timer, tombstone_size);
+        report(scene, "compact", compact_timer, compact_tree_ptr->size());
+        report(scene, "compacted_knn_k5", after_timer, compact_tree_ptr->size());
+    }
+}
+
+/*
+    Mixed workload: clustered insertions keep the rebuild thread busy while searches run
+*/
+
+void run_concurrent_rebuild_workload(const std::string &scene, PointVector &cloud, int query_num)
+{
+    KD_TREE<PointType>::Ptr tree_ptr(new KD_TREE<PointType>(0.3, 0.6, Downsample_Size));
+    KD_TREE<PointType> &ikd_Tree = *tree_ptr;
+    ikd_Tree.Build(cloud);
+    PointVector search_result;
+    vector<float> distances;
+    Case_Timer insert_timer, knn_timer;
+    int rounds = std::max(1, query_num / 100);
+    for (int round = 0; round < rounds; round++)
+    {
+        // Insert a dense cluster to unbalance one subtree past Multi_Thread_Rebuild_Point_Num
+        PointType center = query_near(cloud);
+        PointVector batch;
+        for (int i = 0; i < Insert_Batch_Size; i++)
+            batch.push_back(make_point(center.x + rand_float(0, 2), center.y + rand_float(0, 2), center.z + rand_float(0, 2)));
+        insert_timer.start();
+        ikd_Tree.Add_Points(batch, false);
+        insert_timer.stop(batch.size());
+        for (int i = 0; i < 100; i++)
+        {
+            PointType target = query_near(cloud);
+            knn_timer.start();
+            ikd_Tree.Nearest_Search(target, 5, search_result, distances);
+            knn_timer.stop();
+        }
+    }
+    report(scene, "mixed_insert", insert_timer, ikd_Tree.size());
+    report(scene, "mixed_knn_k5", knn_timer, ikd_Tree.size());
+}
+
+/*
+    Sliding window around a moving sensor: downsampled insertion of each scan,
+    removal of the map behind the sensor and k-nearest search for every scan point.
+    With recorded scans the frames are used as they are.
+*/
+
+// How the points behind the sensor leave the map
+enum Window_Mode
+{
+    BOX_DELETE_WINDOW,
+    MAP_WINDOW,
+    TIME_WINDOW
+};
+
+void run_sliding_window_workload(const std::string &scene, std::vector<PointVector> &frames, int frame_num, Window_Mode mode = BOX_DELETE_WINDOW)
+{
+    KD_TREE<PointType>::Ptr tree_ptr(new KD_TREE<PointType>(0.3, 0.6, Downsample_Size));
+    KD_TREE<PointType> &ikd_Tree = *tree_ptr;
+    PointVector scan, search_result;
+    vector<float> distances;
+    Case_Timer insert_timer, delete_timer, knn_timer;
+    float sensor_x = 0.0;
+    for (int frame = 0; frame < frame_num; frame++)
+    {
+        PointVector().swap(scan);
+        if (frames.empty())
+            generate_scan(sensor_x, Scan_Point_Num, scan);
+        else
+            scan = frames[frame];
+        if (frame == 0)
+        {
+#if TIMESTAMP_SWITCH
+            ikd_Tree.Build(scan, frame);
+#else
+            ikd_Tree.Build(scan);
+#endif
+            continue;
+        }
+        for (size_t i = 0; i < scan.size(); i += 10)
+        {
+            knn_timer.start();
+            ikd_Tree.Nearest_Search(scan[i], 5, search_result, distances);
+            knn_timer.stop();
+        }
+        insert_timer.start();
+#if TIMESTAMP_SWITCH
+        ikd_Tree.Add_Points(scan, true, frame);
+#else
+        ikd_Tree.Add_Points(scan, true);
+#endif
+        insert_timer.stop(scan.size());
+        if (frames.empty() && mode == TIME_WINDOW)
+        {
+#if TIMESTAMP_SWITCH
+            // The scans of the last Window_Length of travel, about the map kept by the box delete below
+            delete_timer.start();
+            ikd_Tree.Delete_Older_Than(frame - Window_Length / Sensor_Step);
+            delete_timer.stop();
+#endif
+        }
+        else if (frames.empty() && mode == MAP_WINDOW)
+        {
+            // The same map maintained by the tree: a cube around the sensor, moved once the sensor is a sensor range from its face
+            delete_timer.start();
+            ikd_Tree.Update_Map_Window(make_point(sensor_x, 0, 0), Window_Length, Sensor_Range);
+            delete_timer.stop();
+        }
+        else if (frames.empty())
+        {
+            BoxPointType behind;
+            behind.vertex_min[0] = sensor_x - Window_Length - Sensor_Range - 2 * Sensor_Step;
+            behind.vertex_max[0] = sensor_x - Window_Length;
+            behind.vertex_min[1] = behind.vertex_min[2] = -1000;
+            behind.vertex_max[1] = behind.vertex_max[2] = 1000;
+            vector<BoxPointType> boxes(1, behind);
+            delete_timer.start();
+            ikd_Tree.Delete_Point_Boxes(boxes);
+            delete_timer.stop();
+        }
+        sensor_x += Sensor_Step;
+    }
+    const char *prefix[] = {"window_", "map_window_", "time_window_"};
+    const char *delete_name[] = {"box_delete", "update", "delete_older"};
+    report(scene, std::string(prefix[mode]) + "knn_k5", knn_timer, ikd_Tree.size());
+    report(scene, std::string(prefix[mode]) + "insert_downsample", insert_timer, ikd_Tree.size());
+    report(scene, std::string(prefix[mode]) + delete_name[mode], delete_timer, ikd_Tree.size());
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int seed = 42;
+    int point_num = Default_Point_Num;
+    int query_num = Default_Query_Num;
+    std::string scene_name = "all";
+    std::vector<const char *> scan_files;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+            seed = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--points") && i + 1 < argc)
+            point_num = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--queries") && i + 1 < argc)
+            query_num = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--scene") && i + 1 < argc)
+            scene_name = argv[++i];
+        else if (!strcmp(argv[i], "--format") && i + 1 < argc)
+            csv_output = !strcmp(argv[++i], "csv");
+        else if (!strcmp(argv[i], "--output") && i + 1 < argc)
+        {
+            output = fopen(argv[++i], "w");
+            if (output == nullptr)
+            {
+                fprintf(stderr, "Couldn't open %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--scan"))
+            while (i + 1 < argc && strncmp(argv[i + 1], "--", 2))
+                scan_files.push_back(argv[++i]);
+        else
+        {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+    rng.seed(seed);
+    if (csv_output)
+        fprintf(output, "scene,case,ops,ns_per_op,p50_ns,p90_ns,p99_ns,max_ns,tree_size,recall\n");
+    typedef void (*Scene_Generator)(int, PointVector &);
+    std::vector<std::pair<std::string, Scene_Generator>> scenes = {{"uniform", generate_uniform}, {"planar", generate_planar}, {"corridor", generate_corridor}};
+    for (auto &scene : scenes)
+    {
+        if (scene_name != "all" && scene_name != scene.first)
+            continue;
+        PointVector cloud;
+        scene.second(point_num, cloud);
+        run_static_workloads(scene.first, cloud, query_num);
+        run_concurrent_rebuild_workload(scene.first, cloud, query_num);
+    }
+    std::vector<PointVector> frames;
+    if (scene_name == "all" || scene_name == "sliding")
+    {
+        run_sliding_window_workload("sliding", frames, std::max(2, query_num / 100));
+        run_sliding_window_workload("sliding", frames, std::max(2, query_num / 100), MAP_WINDOW);
+#if TIMESTAMP_SWITCH
+        run_sliding_window_workload("sliding", frames, std::max(2, query_num / 100), TIME_WINDOW);
+#endif
+    }
+    if (!scan_files.empty())
+    {
+        PointVector recorded;
+        for (const char *filename : scan_files)
+        {
+            PointVector().swap(recorded);
+            if (!load_kitti_scan(filename, recorded) || recorded.empty())
+            {
+                fprintf(stderr, "Couldn't read scan %s\n", filename);
+                return 1;
+            }
+            frames.push_back(recorded);
+        }
+        PointVector cloud;
+        for (auto &frame : frames)
+            cloud.insert(cloud.end(), frame.begin(), frame.end());
+        run_static_workloads("recorded", cloud, query_num);
+        run_sliding_window_workload("recorded", frames, frames.size());
+    }
+    if (output != stdout)
+        fclose(output);
+    return 0;
+}
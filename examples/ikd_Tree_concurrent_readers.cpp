@@ -0,0 +1,246 @@
+/*
+Description: Stress test of the concurrent readers mode. Reader threads run k-nearest, box and radius searches on one tree
+             while the main thread keeps adding and deleting points and the rebuild thread rebalances it. A grid of core
+             points below z = 0 is never touched, so every answer can be checked against it whatever the state the
+             reader saw. Build the ikd_tree_concurrent_readers_tsan target to run it under ThreadSanitizer.
+
+Usage: ikd_tree_concurrent_readers [--readers N] [--seconds S] [--seed N]
+*/
+#include "ikd_Tree.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include "pcl/point_types.h"
+
+using PointType = pcl::PointXYZ;
+using PointVector = KD_TREE<PointType>::PointVector;
+
+#define Grid_Half_Length 20
+#define Grid_Depth 20
+#define Dynamic_Height 20.0f
+#define Insert_Batch_Size 2000
+#define Delete_Box_Length 2.0f
+#define K_Nearest 5
+#define Search_Box_Length 1.5f
+#define Search_Radius 1.5f
+
+std::atomic<bool> stop_flag(false);
+std::atomic<int> violations(0);
+
+PointType make_point(float x, float y, float z)
+{
+    PointType point;
+    point.x = x;
+    point.y = y;
+    point.z = z;
+    return point;
+}
+
+/*
+    Core grid: integer x, y in [-Grid_Half_Length, Grid_Half_Length] and z in [-Grid_Depth, -1]
+*/
+
+void generate_core(PointVector &cloud)
+{
+    for (int x = -Grid_Half_Length; x <= Grid_Half_Length; x++)
+        for (int y = -Grid_Half_Length; y <= Grid_Half_Length; y++)
+            for (int z = -Grid_Depth; z <= -1; z++)
+                cloud.push_back(make_point(x, y, z));
+}
+
+float clamp_axis(float value, int low, int high)
+{
+    return std::min(float(high), std::max(float(low), roundf(value)));
+}
+
+// Squared distance from the query to its nearest core point
+float core_nearest_dist(const PointType &point)
+{
+    float dx = point.x - clamp_axis(point.x, -Grid_Half_Length, Grid_Half_Length);
+    float dy = point.y - clamp_axis(point.y, -Grid_Half_Length, Grid_Half_Length);
+    float dz = point.z - clamp_axis(point.z, -Grid_Depth, -1);
+    return dx * dx + dy * dy + dz * dz;
+}
+
+bool is_core(const PointType &point)
+{
+    return point.z < 0.0f && point.x == roundf(point.x) && point.y == roundf(point.y) && point.z == roundf(point.z);
+}
+
+// Boxes hold the points with vertex_min <= x < vertex_max
+int core_num_in_box(const BoxPointType &box)
+{
+    int num[3];
+    int low[3] = {-Grid_Half_Length, -Grid_Half_Length, -Grid_Depth}, high[3] = {Grid_Half_Length, Grid_Half_Length, -1};
+    for (int i = 0; i < 3; i++)
+    {
+        int first = std::max(low[i], int(ceilf(box.vertex_min[i])));
+        int last = std::min(high[i], int(ceilf(box.vertex_max[i])) - 1);
+        num[i] = std::max(0, last - first + 1);
+    }
+    return num[0] * num[1] * num[2];
+}
+
+int core_num_in_ball(const PointType &center, float radius)
+{
+    int num = 0;
+    for (int x = int(ceilf(center.x - radius)); x <= int(floorf(center.x + radius)); x++)
+        for (int y = int(ceilf(center.y - radius)); y <= int(floorf(center.y + radius)); y++)
+            for (int z = int(ceilf(center.z - radius)); z <= int(floorf(center.z + radius)); z++)
+            {
+                if (abs(x) > Grid_Half_Length || abs(y) > Grid_Half_Length || z < -Grid_Depth || z > -1)
+                    continue;
+                float dist = (x - center.x) * (x - center.x) + (y - center.y) * (y - center.y) + (z - center.z) * (z - center.z);
+                num += dist < radius * radius;
+            }
+    return num;
+}
+
+float squared_dist(const PointType &a, const PointType &b)
+{
+    return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) + (a.z - b.z) * (a.z - b.z);
+}
+
+void report_violation(int reader, const char *what, float expected, float found)
+{
+    if (violations.fetch_add(1) < 10)
+        printf("Reader %d: %s, expected %f found %f\n", reader, what, expected, found);
+}
+
+/*
+    Reader: every answer holds at least the untouched core points, and only points that are or were in the tree
+*/
+
+void run_reader(KD_TREE<PointType> *tree, int reader, unsigned int seed, long *query_num)
+{
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> horizontal(-Grid_Half_Length, Grid_Half_Length);
+    std::uniform_real_distribution<float> vertical(-3.0f, 3.0f);
+    PointVector result;
+    vector<float> distances;
+    long num = 0;
+    while (!stop_flag.load())
+    {
+        PointType query = make_point(horizontal(rng), horizontal(rng), vertical(rng));
+        tree->Nearest_Search(query, K_Nearest, result, distances);
+        if (int(result.size()) != K_Nearest)
+            report_violation(reader, "k-nearest size", K_Nearest, result.size());
+        for (size_t i = 0; i < result.size(); i++)
+        {
+            if (fabs(squared_dist(result[i], query) - distances[i]) > 1e-3f * (1.0f + distances[i]))
+                report_violation(reader, "k-nearest distance", squared_dist(result[i], query), distances[i]);
+            if ((i > 0 && distances[i] < distances[i - 1]) || (!is_core(result[i]) && result[i].z < 0.0f))
+                report_violation(reader, "k-nearest point", i, distances[i]);
+        }
+        if (!distances.empty() && distances[0] > core_nearest_dist(query) + 1e-4f)
+            report_violation(reader, "nearest distance", core_nearest_dist(query), distances[0]);
+        BoxPointType box;
+        box.vertex_min[0] = query.x - Search_Box_Length;
+        box.vertex_max[0] = query.x + Search_Box_Length;
+        box.vertex_min[1] = query.y - Search_Box_Length;
+        box.vertex_max[1] = query.y + Search_Box_Length;
+        box.vertex_min[2] = query.z - Search_Box_Length;
+        box.vertex_max[2] = query.z + Search_Box_Length;
+        tree->Box_Search(box, result);
+        int core_num = 0;
+        for (const PointType &point : result)
+        {
+            if (point.x < box.vertex_min[0] || point.x >= box.vertex_max[0] || point.y < box.vertex_min[1] || point.y >= box.vertex_max[1] ||
+                point.z < box.vertex_min[2] || point.z >= box.vertex_max[2])
+                report_violation(reader, "box point outside", 0, point.z);
+            core_num += is_core(point);
+        }
+        if (core_num != core_num_in_box(box))
+            report_violation(reader, "box core points", core_num_in_box(box), core_num);
+        tree->Radius_Search(query, Search_Radius, result);
+        core_num = 0;
+        for (const PointType &point : result)
+        {
+            if (squared_dist(point, query) > Search_Radius * Search_Radius * 1.001f)
+                report_violation(reader, "radius point outside", Search_Radius * Search_Radius, squared_dist(point, query));
+            core_num += is_core(point);
+        }
+        if (core_num < core_num_in_ball(query, Search_Radius * 0.999f))
+            report_violation(reader, "radius core points", core_num_in_ball(query, Search_Radius * 0.999f), core_num);
+        num += 3;
+    }
+    *query_num = num;
+}
+
+int main(int argc, char **argv)
+{
+    int reader_num = std::max(2, int(std::thread::hardware_concurrency()) - 1);
+    double seconds = 5.0;
+    unsigned int seed = 42;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--readers") && i + 1 < argc)
+            reader_num = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--seconds") && i + 1 < argc)
+            seconds = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+            seed = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> horizontal(-Grid_Half_Length, Grid_Half_Length);
+    std::uniform_real_distribution<float> vertical(0.0f, Dynamic_Height);
+    KD_TREE<PointType>::Ptr tree_ptr(new KD_TREE<PointType>(0.3, 0.6, 0.2));
+    KD_TREE<PointType> &ikd_Tree = *tree_ptr;
+    PointVector core;
+    generate_core(core);
+    ikd_Tree.Build(core);
+    // The calling thread is the writer
+    ikd_Tree.Set_Concurrent_Readers(true);
+    std::vector<std::thread> readers;
+    std::vector<long> query_nums(reader_num, 0);
+    for (int i = 0; i < reader_num; i++)
+        readers.emplace_back(run_reader, &ikd_Tree, i, seed + 1 + i, &query_nums[i]);
+    // Writer: insertions with downsampling and box deletions above z = 0, which leave the core alone
+    long write_num = 0;
+    PointVector batch, result;
+    vector<float> distances;
+    auto start_time = chrono::steady_clock::now();
+    while (chrono::duration<double>(chrono::steady_clock::now() - start_time).count() < seconds)
+    {
+        PointVector().swap(batch);
+        for (int i = 0; i < Insert_Batch_Size; i++)
+            batch.push_back(make_point(horizontal(rng), horizontal(rng), vertical(rng)));
+        ikd_Tree.Add_Points(batch, true);
+        vector<BoxPointType> boxes(1);
+        PointType center = make_point(horizontal(rng), horizontal(rng), vertical(rng));
+        boxes[0].vertex_min[0] = center.x - Delete_Box_Length;
+        boxes[0].vertex_max[0] = center.x + Delete_Box_Length;
+        boxes[0].vertex_min[1] = center.y - Delete_Box_Length;
+        boxes[0].vertex_max[1] = center.y + Delete_Box_Length;
+        boxes[0].vertex_min[2] = std::max(0.5f, center.z - Delete_Box_Length);
+        boxes[0].vertex_max[2] = center.z + Delete_Box_Length;
+        ikd_Tree.Delete_Point_Boxes(boxes);
+        PointVector removed(batch.begin(), batch.begin() + Insert_Batch_Size / 10);
+        ikd_Tree.Delete_Points(removed);
+        if (write_num % 20 == 19)
+            ikd_Tree.Compact(20000);
+        // The writer's own searches read the tree itself
+        ikd_Tree.Nearest_Search(center, K_Nearest, result, distances);
+        write_num++;
+    }
+    stop_flag = true;
+    long total_queries = 0;
+    for (int i = 0; i < reader_num; i++)
+    {
+        readers[i].join();
+        total_queries += query_nums[i];
+    }
+    printf("%d readers: %ld queries (%.0f per second), %ld writer rounds, tree size %d, %d violations\n", reader_num, total_queries,
+           total_queries / seconds, write_num, ikd_Tree.size(), violations.load());
+    return violations.load() == 0 ? 0 : 1;
+}
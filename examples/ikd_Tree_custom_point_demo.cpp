@@ -0,0 +1,75 @@
+/*
+Description: Using the ikd-Tree without PCL. The tree is compiled header-only for a compact
+             user-defined point struct and Eigen::Vector3f, a 2D tree on Eigen::Vector2f and a
+             4D tree on points with a timestamp axis, whose traits are specialized below.
+*/
+#define KD_TREE_HEADER_ONLY
+#include "ikd_Tree.h"
+#include <stdio.h>
+#include <random>
+
+// 16 bytes instead of the 32 bytes of pcl::PointXYZI
+struct MapPoint
+{
+    float x, y, z;
+    uint16_t intensity;
+    uint16_t ring;
+};
+
+// x, y, z and the scan time, searched as a 4D point
+struct TimedPoint
+{
+    float x, y, z;
+    float time;
+};
+
+template <>
+struct KD_TREE_Point_Traits<TimedPoint>
+{
+    static inline float get(const TimedPoint &point, int axis)
+    {
+        return axis == 3 ? point.time : (&point.x)[axis];
+    }
+    static inline void set(TimedPoint &point, int axis, float value)
+    {
+        if (axis == 3)
+            point.time = value;
+        else
+            (&point.x)[axis] = value;
+    }
+};
+
+template <typename PointType, int DIM = 3>
+void run_demo(const char *name)
+{
+    typename KD_TREE<PointType, DIM>::Ptr kdtree_ptr(new KD_TREE<PointType, DIM>(0.3, 0.6, 0.2));
+    KD_TREE<PointType, DIM> &ikd_Tree = *kdtree_ptr;
+    using Traits = KD_TREE_Point_Traits<PointType>;
+
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<float> uniform(-10.0, 10.0);
+    typename KD_TREE<PointType, DIM>::PointVector cloud(20000);
+    for (auto &point : cloud)
+    {
+        for (int axis = 0; axis < DIM; axis++)
+            Traits::set(point, axis, uniform(rng));
+    }
+    ikd_Tree.Build(cloud);
+
+    PointType query;
+    for (int axis = 0; axis < DIM; axis++)
+        Traits::set(query, axis, uniform(rng));
+    typename KD_TREE<PointType, DIM>::PointVector nearest;
+    vector<float> distances;
+    ikd_Tree.Nearest_Search(query, 5, nearest, distances);
+    printf("%s (%dD): %d points in the tree, point size %d bytes, nearest distance %0.4f\n", name, DIM, ikd_Tree.validnum(), int(sizeof(PointType)), sqrt(distances[0]));
+}
+
+int main(int argc, char **argv)
+{
+    run_demo<MapPoint>("MapPoint");
+    run_demo<Eigen::Vector3f>("Eigen::Vector3f");
+    run_demo<Eigen::Vector2f, 2>("Eigen::Vector2f");
+    run_demo<TimedPoint, 4>("TimedPoint");
+    return 0;
+}
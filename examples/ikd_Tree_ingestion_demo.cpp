@@ -0,0 +1,133 @@
+/*
+Description: Time spent on the odometry thread per scan with inline insertion and with the ingestion queue. Each scan of a
+             sensor moving along x is matched against the map (k-nearest search for a part of its points) and then
+             inserted with downsampling, by Add_Points on one tree and by Enqueue_Points on another. Both maps must hold
+             the same points once the queue is flushed.
+
+Usage: ikd_tree_ingestion_demo [--scans N] [--scan-size N] [--seed N]
+*/
+#include "ikd_Tree.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <random>
+#include <vector>
+#include "pcl/point_types.h"
+
+using PointType = pcl::PointXYZ;
+using PointVector = KD_TREE<PointType>::PointVector;
+
+#define Sensor_Range 30.0f
+#define Sensor_Step 0.5f
+#define Query_Step 10
+#define K_Nearest 5
+#define Downsample_Size 0.5f
+
+struct Scan_Timing
+{
+    double total_us = 0.0;
+    double max_us = 0.0;
+    void add(double us)
+    {
+        total_us += us;
+        max_us = std::max(max_us, us);
+    }
+};
+
+void generate_scan(std::mt19937 &rng, float sensor_x, int scan_size, PointVector &scan)
+{
+    // Points on the ground and on two walls along the path
+    std::uniform_real_distribution<float> along(-Sensor_Range, Sensor_Range), height(0.0f, 5.0f);
+    std::uniform_int_distribution<int> surface(0, 2);
+    scan.clear();
+    for (int i = 0; i < scan_size; i++)
+    {
+        PointType point;
+        point.x = sensor_x + along(rng);
+        int s = surface(rng);
+        point.y = s == 0 ? along(rng) / 3.0f : (s == 1 ? -10.0f : 10.0f);
+        point.z = s == 0 ? 0.0f : height(rng);
+        scan.push_back(point);
+    }
+}
+
+double elapsed_us(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double, std::micro>(chrono::steady_clock::now() - start).count();
+}
+
+void match_scan(KD_TREE<PointType> &tree, const PointVector &scan)
+{
+    PointVector nearest;
+    vector<float> distances;
+    for (size_t i = 0; i < scan.size(); i += Query_Step)
+        tree.Nearest_Search(scan[i], K_Nearest, nearest, distances);
+}
+
+int main(int argc, char **argv)
+{
+    int scan_num = 200, scan_size = 20000;
+    unsigned int seed = 42;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--scans") && i + 1 < argc)
+            scan_num = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--scan-size") && i + 1 < argc)
+            scan_size = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+            seed = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+    KD_TREE<PointType>::Ptr inline_tree(new KD_TREE<PointType>(0.3, 0.6, Downsample_Size));
+    KD_TREE<PointType>::Ptr queued_tree(new KD_TREE<PointType>(0.3, 0.6, Downsample_Size));
+    std::mt19937 rng(seed);
+    PointVector scan;
+    generate_scan(rng, 0.0f, scan_size, scan);
+    inline_tree->Build(scan);
+    queued_tree->Build(scan);
+    Scan_Timing inline_timing, queued_timing;
+    int failures = 0;
+    for (int i = 1; i <= scan_num; i++)
+    {
+        generate_scan(rng, i * Sensor_Step, scan_size, scan);
+        auto start = chrono::steady_clock::now();
+        match_scan(*inline_tree, scan);
+        inline_tree->Add_Points(scan, true);
+        inline_timing.add(elapsed_us(start));
+        start = chrono::steady_clock::now();
+        match_scan(*queued_tree, scan);
+        uint64_t sequence = queued_tree->Enqueue_Points(scan, true);
+        queued_timing.add(elapsed_us(start));
+        if (i % 50 == 0)
+        {
+            // Once its batch is applied, a point of the scan has a map point in its downsample cell
+            queued_tree->Wait_For(sequence);
+            BoxPointType cell;
+            for (int k = 0; k < 3; k++)
+            {
+                float coordinate = k == 0 ? scan[0].x : (k == 1 ? scan[0].y : scan[0].z);
+                cell.vertex_min[k] = floor(coordinate / Downsample_Size) * Downsample_Size;
+                cell.vertex_max[k] = cell.vertex_min[k] + Downsample_Size;
+            }
+            PointVector found;
+            queued_tree->Box_Search(cell, found);
+            if (found.empty())
+            {
+                printf("Scan %d not visible after Wait_For\n", i);
+                failures++;
+            }
+        }
+    }
+    queued_tree->Flush();
+    printf("Odometry thread per scan: inline %0.1f us (max %0.1f), queued %0.1f us (max %0.1f)\n", inline_timing.total_us / scan_num,
+           inline_timing.max_us, queued_timing.total_us / scan_num, queued_timing.max_us);
+    printf("Valid points: inline %d, queued %d\n", inline_tree->validnum(), queued_tree->validnum());
+    if (inline_tree->validnum() != queued_tree->validnum())
+        failures++;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,330 @@
+/*
+Description: Replays an operation trace recorded with KD_TREE::start_trace and reports the latency of every call.
+             By default the calls are replayed as fast as possible, with --realtime the recorded
+             timestamps are respected so that the rebuild thread sees the original pacing.
+             Traces with point times (Delete_Older_Than, Nearest_Search_Recent, timed adds) are replayed
+             faithfully by the ikd_tree_replay_timestamps target, built with TIMESTAMP_SWITCH.
+
+Usage: ikd_tree_replay trace.bin [--realtime] [--per-call latency.csv]
+*/
+#include "ikd_Tree.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <unordered_map>
+#include "pcl/point_types.h"
+
+using PointType = pcl::PointXYZ;
+using PointVector = KD_TREE<PointType>::PointVector;
+
+const char *operation_name[] = {"Build", "Add_Points", "Delete_Points", "Add_Point_Boxes", "Delete_Point_Boxes", "Nearest_Search", "Box_Search", "Radius_Search", "Delete_By_Id", "Crop_To_Box",
+                                "Radius_Search_Capped", "Delete_Older_Than", "Nearest_Search_Recent", "Compact", "Merge",
+                                "Set_Map_Transform", "Rebake", "Nearest_Plane", "Nearest_Plane_Batch"};
+#define Operation_Num 19
+
+bool read_record(FILE *fp, uint32_t version, KD_TREE_Trace_Record &record)
+{
+    // Records before version 4 end after param[1], the later parameters are then 0
+    record = KD_TREE_Trace_Record();
+    size_t size = version < 4 ? sizeof(record) - 2 * sizeof(float) : sizeof(record);
+    return fread(&record, size, 1, fp) == 1;
+}
+
+bool read_points(FILE *fp, int num, PointVector &points)
+{
+    PointVector().swap(points);
+    float xyz[3];
+    PointType point;
+    for (int i = 0; i < num; i++)
+    {
+        if (fread(xyz, sizeof(xyz), 1, fp) != 1)
+            return false;
+        point.x = xyz[0];
+        point.y = xyz[1];
+        point.z = xyz[2];
+        points.push_back(point);
+    }
+    return true;
+}
+
+bool read_boxes(FILE *fp, int num, vector<BoxPointType> &boxes)
+{
+    vector<BoxPointType>().swap(boxes);
+    BoxPointType box;
+    for (int i = 0; i < num; i++)
+    {
+        if (fread(box.vertex_min, sizeof(float), 3, fp) != 3 || fread(box.vertex_max, sizeof(float), 3, fp) != 3)
+            return false;
+        boxes.push_back(box);
+    }
+    return true;
+}
+
+bool read_ids(FILE *fp, int num, vector<uint32_t> &ids)
+{
+    ids.resize(num);
+    return fread(ids.data(), sizeof(uint32_t), num, fp) == size_t(num);
+}
+
+bool read_time(FILE *fp, double &time)
+{
+    return fread(&time, sizeof(double), 1, fp) == 1;
+}
+
+bool read_transform(FILE *fp, KD_TREE_Rigid_Transform &transform)
+{
+    return fread(transform.rotation, sizeof(float), 9, fp) == 9 && fread(transform.translation, sizeof(float), 3, fp) == 3;
+}
+
+bool read_times(FILE *fp, int num, vector<double> &times)
+{
+    times.resize(num);
+    return fread(times.data(), sizeof(double), num, fp) == size_t(num);
+}
+
+// The merged tree is built again from its recorded points, in the order of their times. The ids they got in the recorded
+// session are mapped to the ones they get here, which depend on the layout of the merged tree.
+void replay_merge(KD_TREE<PointType> &tree, const KD_TREE_Trace_Header &header, const PointVector &points, const vector<uint32_t> &ids,
+                  const vector<double> &times, unordered_map<uint32_t, uint32_t> &id_map)
+{
+    KD_TREE<PointType> other(header.delete_param, header.balance_param, header.box_length);
+    vector<size_t> order(points.size());
+    iota(order.begin(), order.end(), 0);
+    if (!times.empty())
+        stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return times[a] < times[b]; });
+    for (size_t begin = 0, end; begin < order.size(); begin = end)
+    {
+        end = begin + 1;
+        while (end < order.size() && (times.empty() || times[order[end]] == times[order[begin]]))
+            end++;
+        PointVector group;
+        for (size_t k = begin; k < end; k++)
+            group.push_back(points[order[k]]);
+#if TIMESTAMP_SWITCH
+        double time = times.empty() ? INFINITY : times[order[begin]];
+        if (begin == 0)
+            other.Build(group, time);
+        else
+            other.Add_Points(group, false, time);
+#else
+        if (begin == 0)
+            other.Build(group);
+        else
+            other.Add_Points(group, false);
+#endif
+    }
+    // other numbered its points in that order
+    vector<uint32_t> new_ids;
+    tree.Merge(std::move(other), new_ids);
+    for (size_t k = 0; k < order.size() && k < new_ids.size(); k++)
+    {
+        if (ids[order[k]] != INVALID_POINT_ID && new_ids[k] != ids[order[k]])
+            id_map[ids[order[k]]] = new_ids[k];
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s trace.bin [--realtime] [--per-call latency.csv]\n", argv[0]);
+        return 1;
+    }
+    bool realtime = false;
+    FILE *per_call = nullptr;
+    for (int i = 2; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--realtime"))
+            realtime = true;
+        else if (!strcmp(argv[i], "--per-call") && i + 1 < argc)
+            per_call = fopen(argv[++i], "w");
+    }
+    FILE *fp = fopen(argv[1], "rb");
+    if (fp == nullptr)
+    {
+        printf("Couldn't read trace %s\n", argv[1]);
+        return 1;
+    }
+    KD_TREE_Trace_Header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != TRACE_MAGIC || header.version < 2 || header.version > TRACE_VERSION)
+    {
+        printf("%s is not an ikd-Tree trace\n", argv[1]);
+        return 1;
+    }
+    if (header.dimension != 3)
+    {
+        printf("%s was recorded from a %u-dimensional tree, only 3 is supported\n", argv[1], header.dimension);
+        return 1;
+    }
+    KD_TREE<PointType>::Ptr kdtree_ptr(new KD_TREE<PointType>(header.delete_param, header.balance_param, header.box_length));
+    KD_TREE<PointType> &ikd_Tree = *kdtree_ptr;
+    if (per_call != nullptr)
+        fprintf(per_call, "index,operation,num,timestamp_ns,latency_ns\n");
+
+    KD_TREE_Histogram latency[Operation_Num];
+    KD_TREE_Trace_Record record;
+    PointVector points, search_result;
+    vector<BoxPointType> boxes;
+    vector<uint32_t> ids;
+    vector<double> times;
+    KD_TREE_Rigid_Transform transform;
+    unordered_map<uint32_t, uint32_t> id_map;
+    vector<float> distances;
+    KD_TREE<PointType>::Plane_Fit plane;
+    vector<KD_TREE<PointType>::Plane_Fit> planes;
+    double time = INFINITY;
+    bool timed_warning = false;
+    int index = 0;
+    auto replay_start = chrono::steady_clock::now();
+    while (read_record(fp, header.version, record))
+    {
+        bool box_operation = record.op == TRACE_ADD_BOXES || record.op == TRACE_DELETE_BOXES || record.op == TRACE_BOX_SEARCH || record.op == TRACE_CROP_BOX;
+        bool read_success;
+        if (record.op == TRACE_SET_TRANSFORM)
+            read_success = read_transform(fp, transform);
+        else if (record.op == TRACE_DELETE_BY_ID)
+            read_success = read_ids(fp, record.num, ids);
+        else
+            read_success = box_operation ? read_boxes(fp, record.num, boxes) : read_points(fp, record.num, points);
+        times.clear();
+        if (record.op == TRACE_MERGE && read_success)
+        {
+            read_success = read_ids(fp, record.num, ids);
+            if (read_success && (record.flag & TRACE_FLAG_TIMED))
+                read_success = read_times(fp, record.num, times);
+        }
+        bool timed = record.op == TRACE_DELETE_OLDER || record.op == TRACE_NEAREST_SEARCH_RECENT ||
+                     ((record.op == TRACE_BUILD || record.op == TRACE_ADD_POINTS) && (record.flag & TRACE_FLAG_TIMED));
+        time = INFINITY;
+        if (timed && read_success)
+            read_success = read_time(fp, time);
+        timed = timed || !times.empty();
+        if (timed && !TIMESTAMP_SWITCH && !timed_warning)
+        {
+            fprintf(stderr, "The trace uses point times, replay it with ikd_tree_replay_timestamps to get the same tree\n");
+            timed_warning = true;
+        }
+        if (record.op >= Operation_Num || !read_success)
+        {
+            printf("Trace is truncated at record %d\n", index);
+            break;
+        }
+        if (realtime)
+        {
+            auto due_time = replay_start + chrono::nanoseconds(record.timestamp);
+            auto now = chrono::steady_clock::now();
+            if (due_time > now)
+                usleep(chrono::duration_cast<chrono::microseconds>(due_time - now).count());
+        }
+        auto t1 = chrono::steady_clock::now();
+        switch (record.op)
+        {
+        case TRACE_BUILD:
+#if TIMESTAMP_SWITCH
+            ikd_Tree.Build(points, time);
+#else
+            ikd_Tree.Build(points);
+#endif
+            break;
+        case TRACE_ADD_POINTS:
+#if TIMESTAMP_SWITCH
+            ikd_Tree.Add_Points(points, record.flag & TRACE_FLAG_DOWNSAMPLE, time);
+#else
+            ikd_Tree.Add_Points(points, record.flag & TRACE_FLAG_DOWNSAMPLE);
+#endif
+            break;
+        case TRACE_DELETE_POINTS:
+            ikd_Tree.Delete_Points(points);
+            break;
+        case TRACE_ADD_BOXES:
+            ikd_Tree.Add_Point_Boxes(boxes);
+            break;
+        case TRACE_DELETE_BOXES:
+            ikd_Tree.Delete_Point_Boxes(boxes);
+            break;
+        case TRACE_NEAREST_SEARCH:
+            ikd_Tree.Nearest_Search(points[0], int(record.param[0]), search_result, distances, record.param[1], record.param[2], int(record.param[3]));
+            break;
+        case TRACE_BOX_SEARCH:
+            ikd_Tree.Box_Search(boxes[0], search_result);
+            break;
+        case TRACE_RADIUS_SEARCH:
+            ikd_Tree.Radius_Search(points[0], record.param[0], search_result);
+            break;
+        case TRACE_DELETE_BY_ID:
+            // Ids are assigned deterministically, so the replayed tree hands out the recorded ones, except for merged points
+            for (uint32_t &id : ids)
+            {
+                auto mapped = id_map.find(id);
+                if (mapped != id_map.end())
+                    id = mapped->second;
+            }
+            ikd_Tree.Delete_By_Id(ids);
+            break;
+        case TRACE_CROP_BOX:
+            ikd_Tree.Crop_To_Box(boxes[0]);
+            break;
+        case TRACE_RADIUS_SEARCH_CAPPED:
+            ikd_Tree.Radius_Search(points[0], record.param[0], int(record.param[1]), search_result, distances);
+            break;
+#if TIMESTAMP_SWITCH
+        case TRACE_DELETE_OLDER:
+            ikd_Tree.Delete_Older_Than(time);
+            break;
+        case TRACE_NEAREST_SEARCH_RECENT:
+            ikd_Tree.Nearest_Search_Recent(points[0], int(record.param[0]), search_result, distances, time, record.param[1]);
+            break;
+#else
+        // Points carry no time in this build: none is older than another
+        case TRACE_DELETE_OLDER:
+            break;
+        case TRACE_NEAREST_SEARCH_RECENT:
+            ikd_Tree.Nearest_Search(points[0], int(record.param[0]), search_result, distances, record.param[1]);
+            break;
+#endif
+        case TRACE_COMPACT:
+            ikd_Tree.Compact(int(record.param[0]), record.param[1]);
+            break;
+        case TRACE_MERGE:
+            replay_merge(ikd_Tree, header, points, ids, times, id_map);
+            break;
+        case TRACE_SET_TRANSFORM:
+            ikd_Tree.Set_Map_Transform(transform);
+            break;
+        case TRACE_REBAKE:
+            ikd_Tree.Rebake();
+            break;
+        case TRACE_NEAREST_PLANE:
+            ikd_Tree.Nearest_Plane(points[0], int(record.param[0]), plane, record.param[2], record.param[1]);
+            break;
+        case TRACE_NEAREST_PLANE_BATCH:
+            ikd_Tree.Nearest_Plane_Batch(points, int(record.param[0]), planes, record.param[2], record.param[1]);
+            break;
+        default:
+            break;
+        }
+        auto t2 = chrono::steady_clock::now();
+        uint64_t duration = chrono::duration_cast<chrono::nanoseconds>(t2 - t1).count();
+        latency[record.op].record(duration);
+        if (per_call != nullptr)
+            fprintf(per_call, "%d,%s,%u,%ld,%lu\n", index, operation_name[record.op], record.num, long(record.timestamp), (unsigned long)duration);
+        index++;
+    }
+    fclose(fp);
+    if (per_call != nullptr)
+        fclose(per_call);
+
+    printf("Replayed %d calls, final tree size is %d (%d valid points)\n", index, ikd_Tree.size(), ikd_Tree.validnum());
+    printf("%-22s %10s %12s %12s %12s %12s\n", "Operation", "Calls", "Mean(us)", "P50(us)", "P99(us)", "Max(us)");
+    for (int i = 0; i < Operation_Num; i++)
+    {
+        if (latency[i].count == 0)
+            continue;
+        printf("%-22s %10lu %12.3f %12.3f %12.3f %12.3f\n", operation_name[i], (unsigned long)latency[i].count, latency[i].mean() / 1e3,
+               latency[i].percentile(0.5) / 1e3, latency[i].percentile(0.99) / 1e3, latency[i].max_value / 1e3);
+    }
+    return 0;
+}
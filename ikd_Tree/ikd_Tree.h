@@ -8,31 +8,384 @@
 #include <math.h>
 #include <algorithm>
 #include <memory.h>
-#include <pcl/point_types.h>
-
-#ifndef __OBJECTS_H__
-#define __OBJECTS_H__
-#include "Headers/Common.hpp"
-#include "Headers/Utils.hpp"
-#include "Headers/Objects.hpp"
-#endif
+#include <stdint.h>
+#include <limits.h>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <map>
+#include <set>
+#include <array>
+#include <Eigen/Core>
+#include <Eigen/Eigenvalues>
 
 #define EPSS 1e-6
 #define Minimal_Unbalanced_Tree_Size 10
 #define Multi_Thread_Rebuild_Point_Num 1500
+#define Multi_Thread_Extract_Point_Num 20000
+#define Extract_Thread_Num 4
 #define DOWNSAMPLE_SWITCH true
 #define ForceRebuildPercentage 0.2
 #define Q_LEN 1000000
+#define Traversal_Stack_Inline_Size 64
+#define Node_Block_Level_Num 4
+#define Search_Hint_Min_Size 256
+#define Ingestion_Queue_Capacity 8
+#define INVALID_POINT_ID 0xFFFFFFFFu
+#define ID_Page_Size 4096
+// Set to false (e.g. -DMETRICS_SWITCH=false) to compile the instrumentation out
+#ifndef METRICS_SWITCH
+#define METRICS_SWITCH true
+#endif
+#define METRICS_BUCKET_NUM 40
+// Set to false to compile out the software prefetch of child nodes during searches
+#ifndef PREFETCH_SWITCH
+#define PREFETCH_SWITCH true
+#endif
+// Set to true to keep the mean and scatter matrix of every subtree, used by Plane_Lookup
+#ifndef MOMENTS_SWITCH
+#define MOMENTS_SWITCH false
+#endif
+// Set to true to keep the time every point was added, used by Delete_Older_Than and Nearest_Search_Recent
+#ifndef TIMESTAMP_SWITCH
+#define TIMESTAMP_SWITCH false
+#endif
+#define QUANTIZED_TILE_NUM 65536
 
 using namespace std;
 
 // typedef pcl::PointXYZINormal PointType;
 // typedef vector<PointType, Eigen::aligned_allocator<PointType>>  PointVector;
 
-struct BoxPointType
+/*
+    Coordinate access used by the tree. The default works for every type with float
+    x, y, z members (PCL points, plain structs) and trees of up to three dimensions,
+    specialize it for other point layouts or for the extra axes of higher dimensional trees.
+*/
+template <typename PointType>
+struct KD_TREE_Point_Traits
+{
+    static inline float get(const PointType &point, int axis)
+    {
+        return axis == 0 ? point.x : (axis == 1 ? point.y : point.z);
+    }
+    static inline void set(PointType &point, int axis, float value)
+    {
+        if (axis == 0)
+            point.x = value;
+        else if (axis == 1)
+            point.y = value;
+        else
+            point.z = value;
+    }
+};
+
+template <int N>
+struct KD_TREE_Point_Traits<Eigen::Matrix<float, N, 1>>
+{
+    static inline float get(const Eigen::Matrix<float, N, 1> &point, int axis)
+    {
+        return point[axis];
+    }
+    static inline void set(Eigen::Matrix<float, N, 1> &point, int axis, float value)
+    {
+        point[axis] = value;
+    }
+};
+
+/*
+    Point storage inside the tree nodes. KD_TREE_Full_Storage keeps the points as they are,
+    KD_TREE_Quantized_Storage keeps int16 offsets from the origin of the tile holding the point,
+    see set_quantization_param. Stored points are only decoded when a point is returned, the
+    coordinates are read through get in the distance and range kernels.
+*/
+template <typename PointType, int DIM>
+struct KD_TREE_Full_Storage
+{
+    struct Type
+    {
+        PointType point;
+    };
+    bool set_quantum(float quantum)
+    {
+        return false;
+    }
+    bool encode(const PointType &point, Type &stored)
+    {
+        stored.point = point;
+        return true;
+    }
+    bool find(const PointType &point, Type &stored) const
+    {
+        stored.point = point;
+        return true;
+    }
+    void decode(const Type &stored, PointType &point) const
+    {
+        point = stored.point;
+    }
+    float get(const Type &stored, int axis) const
+    {
+        return KD_TREE_Point_Traits<PointType>::get(stored.point, axis);
+    }
+};
+
+/*
+    Coordinates are rounded to a multiple of quantum and stored as int16 offsets from the center
+    of a tile of 65536 quanta per axis (655 m at 1 cm), plus a 16-bit tile index. Only the
+    coordinates are kept: the other fields of a returned point are default-initialized.
+    Tiles are created by the writer thread and never move, so the rebuild thread and the
+    searches can decode without locking.
+*/
+template <typename PointType, int DIM>
+struct KD_TREE_Quantized_Storage
+{
+    struct Type
+    {
+        int16_t offset[DIM];
+        uint16_t tile;
+    };
+    float quantum = 0.01f;
+    float tile_length = 655.36f;
+    vector<float> tile_origin;
+    std::map<std::array<int32_t, DIM>, uint16_t> tile_index;
+    int tile_num = 0;
+    int last_tile = -1;
+    std::array<int32_t, DIM> last_tile_key;
+
+    bool set_quantum(float new_quantum)
+    {
+        if (tile_num > 0 || new_quantum <= 0)
+            return false;
+        quantum = new_quantum;
+        tile_length = 65536 * quantum;
+        return true;
+    }
+    bool tile_key(const PointType &point, std::array<int32_t, DIM> &key) const
+    {
+        for (int i = 0; i < DIM; i++)
+            key[i] = int32_t(floor(KD_TREE_Point_Traits<PointType>::get(point, i) / tile_length));
+        return true;
+    }
+    void quantize(const PointType &point, int tile, Type &stored) const
+    {
+        stored.tile = tile;
+        for (int i = 0; i < DIM; i++)
+        {
+            long offset = lround((KD_TREE_Point_Traits<PointType>::get(point, i) - tile_origin[tile * DIM + i]) / quantum);
+            stored.offset[i] = int16_t(max(-32768L, min(32767L, offset)));
+        }
+    }
+    bool encode(const PointType &point, Type &stored)
+    {
+        std::array<int32_t, DIM> key;
+        tile_key(point, key);
+        if (last_tile < 0 || key != last_tile_key)
+        {
+            auto iter = tile_index.find(key);
+            if (iter == tile_index.end())
+            {
+                if (tile_num >= QUANTIZED_TILE_NUM)
+                    return false;
+                // Sized once, so that concurrent decodes never see a reallocation
+                if (tile_origin.empty())
+                    tile_origin.resize(QUANTIZED_TILE_NUM * DIM);
+                for (int i = 0; i < DIM; i++)
+                    tile_origin[tile_num * DIM + i] = (key[i] + 0.5f) * tile_length;
+                iter = tile_index.insert(make_pair(key, uint16_t(tile_num))).first;
+                tile_num++;
+            }
+            last_tile = iter->second;
+            last_tile_key = key;
+        }
+        quantize(point, last_tile, stored);
+        return true;
+    }
+    bool find(const PointType &point, Type &stored) const
+    {
+        std::array<int32_t, DIM> key;
+        tile_key(point, key);
+        auto iter = tile_index.find(key);
+        if (iter == tile_index.end())
+            return false;
+        quantize(point, iter->second, stored);
+        return true;
+    }
+    void decode(const Type &stored, PointType &point) const
+    {
+        point = PointType();
+        for (int i = 0; i < DIM; i++)
+            KD_TREE_Point_Traits<PointType>::set(point, i, get(stored, i));
+    }
+    float get(const Type &stored, int axis) const
+    {
+        return tile_origin[stored.tile * DIM + axis] + stored.offset[axis] * quantum;
+    }
+};
+
+template <int DIM>
+struct KD_TREE_Box
 {
-    float vertex_min[3];
-    float vertex_max[3];
+    float vertex_min[DIM];
+    float vertex_max[DIM];
+};
+using BoxPointType = KD_TREE_Box<3>;
+
+/*
+    Rigid transform p' = rotation * p + translation of the first three axes, used for the map
+    frame of a tree and for boxes given in another frame than the stored points.
+*/
+struct KD_TREE_Rigid_Transform
+{
+    float rotation[3][3] = {{1.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f}, {0.0f, 0.0f, 1.0f}};
+    float translation[3] = {0.0f, 0.0f, 0.0f};
+
+    void apply(const float in[3], float out[3]) const
+    {
+        for (int i = 0; i < 3; i++)
+            out[i] = rotation[i][0] * in[0] + rotation[i][1] * in[1] + rotation[i][2] * in[2] + translation[i];
+    }
+    void apply_inverse(const float in[3], float out[3]) const
+    {
+        float offset[3] = {in[0] - translation[0], in[1] - translation[1], in[2] - translation[2]};
+        for (int i = 0; i < 3; i++)
+            out[i] = rotation[0][i] * offset[0] + rotation[1][i] * offset[1] + rotation[2][i] * offset[2];
+    }
+    KD_TREE_Rigid_Transform inverse() const
+    {
+        KD_TREE_Rigid_Transform result;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                result.rotation[i][j] = rotation[j][i];
+        float zero[3] = {0.0f, 0.0f, 0.0f};
+        apply_inverse(zero, result.translation);
+        return result;
+    }
+    // this * other, other is applied first
+    KD_TREE_Rigid_Transform compose(const KD_TREE_Rigid_Transform &other) const
+    {
+        KD_TREE_Rigid_Transform result;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                result.rotation[i][j] = rotation[i][0] * other.rotation[0][j] + rotation[i][1] * other.rotation[1][j] + rotation[i][2] * other.rotation[2][j];
+        apply(other.translation, result.translation);
+        return result;
+    }
+    // Rounding in composed rotations adds up, the inverse (the transpose) then no longer undoes the transform
+    void orthonormalize()
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            for (int k = 0; k < i; k++)
+            {
+                float dot = rotation[i][0] * rotation[k][0] + rotation[i][1] * rotation[k][1] + rotation[i][2] * rotation[k][2];
+                for (int j = 0; j < 3; j++)
+                    rotation[i][j] -= dot * rotation[k][j];
+            }
+            float norm = sqrt(rotation[i][0] * rotation[i][0] + rotation[i][1] * rotation[i][1] + rotation[i][2] * rotation[i][2]);
+            for (int j = 0; j < 3; j++)
+                rotation[i][j] /= norm;
+        }
+    }
+    bool has_rotation() const
+    {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                if (rotation[i][j] != (i == j ? 1.0f : 0.0f))
+                    return true;
+        return false;
+    }
+    bool has_translation() const
+    {
+        return translation[0] != 0.0f || translation[1] != 0.0f || translation[2] != 0.0f;
+    }
+};
+
+/*
+    Log2 histogram: bucket i counts the samples in [2^i, 2^(i+1)).
+    Latencies are recorded in nanoseconds.
+*/
+struct KD_TREE_Histogram
+{
+    uint64_t bucket[METRICS_BUCKET_NUM];
+    uint64_t count;
+    uint64_t total;
+    uint64_t max_value;
+    KD_TREE_Histogram()
+    {
+        clear();
+    }
+    void clear()
+    {
+        memset(bucket, 0, sizeof(bucket));
+        count = 0;
+        total = 0;
+        max_value = 0;
+    }
+    void record(uint64_t value)
+    {
+        int index = 0;
+        while (index < METRICS_BUCKET_NUM - 1 && (value >> (index + 1)) != 0)
+            index++;
+        bucket[index]++;
+        count++;
+        total += value;
+        if (value > max_value)
+            max_value = value;
+    }
+    double mean() const
+    {
+        return count == 0 ? 0.0 : double(total) / count;
+    }
+    // Linearly interpolated inside the bucket, p in [0,1]
+    double percentile(double p) const
+    {
+        if (count == 0)
+            return 0.0;
+        double rank = p * count;
+        uint64_t accumulated = 0;
+        for (int i = 0; i < METRICS_BUCKET_NUM; i++)
+        {
+            if (bucket[i] == 0)
+                continue;
+            if (accumulated + bucket[i] >= rank)
+            {
+                double lower = (i == 0) ? 0.0 : double(uint64_t(1) << i);
+                double upper = double(uint64_t(1) << (i + 1));
+                double value = lower + (upper - lower) * (rank - accumulated) / bucket[i];
+                return value < double(max_value) ? value : double(max_value);
+            }
+            accumulated += bucket[i];
+        }
+        return double(max_value);
+    }
+};
+
+struct KD_TREE_Metrics
+{
+    // Per-call latency (ns) of the public operations
+    KD_TREE_Histogram add_points;
+    KD_TREE_Histogram nearest_search;
+    KD_TREE_Histogram box_search;
+    KD_TREE_Histogram delete_point_boxes;
+    KD_TREE_Histogram delete_older_than;
+    KD_TREE_Histogram nearest_search_recent;
+    KD_TREE_Histogram compact;
+    // One per query of Nearest_Plane and Nearest_Plane_Batch
+    KD_TREE_Histogram nearest_plane;
+    // Radius_Search and Radius_Search_ID with max_num
+    KD_TREE_Histogram radius_search_capped;
+    // Crop_To_Box, also called by Update_Map_Window
+    KD_TREE_Histogram crop_to_box;
+    // Duration (ns) and count of rebuilds done in place and by the rebuild thread
+    KD_TREE_Histogram sync_rebuild;
+    KD_TREE_Histogram multi_thread_rebuild;
+    // Number of tree nodes visited by each Nearest_Search
+    KD_TREE_Histogram search_visited_nodes;
+    // Time (ns) spent waiting on search_flag_mutex for the rebuild thread
+    KD_TREE_Histogram search_flag_wait;
+    int rebuild_logger_size = 0;
+    int rebuild_logger_max_size = 0;
 };
 
 enum operation_set
@@ -42,7 +395,10 @@ enum operation_set
     DELETE_BOX,
     ADD_BOX,
     DOWNSAMPLE_DELETE,
-    PUSH_DOWN
+    PUSH_DOWN,
+    DELETE_POINT_ID,
+    DELETE_OLDER,
+    RESTORE_POINT
 };
 
 enum delete_point_storage_set
@@ -52,7 +408,73 @@ enum delete_point_storage_set
     MULTI_THREAD_REC
 };
 
-template <typename PointType>
+/*
+    Operation trace: a file header followed by one record per public call.
+    Each record is followed by num points (one float per dimension), num boxes
+    (vertex_min, vertex_max as float) or num point ids (uint32_t) depending on the operation,
+    then by a time (double) for TRACE_DELETE_OLDER, TRACE_NEAREST_SEARCH_RECENT and timed adds.
+    TRACE_MERGE has num points, then the num ids they received, then with TRACE_FLAG_TIMED
+    num times. TRACE_SET_TRANSFORM has one transform: its rotation by rows, then its translation.
+    Apply_Map_Transform is recorded as the TRACE_SET_TRANSFORM of the composed transform.
+*/
+#define TRACE_MAGIC 0x54444B49 // "IKDT"
+#define TRACE_VERSION 4
+#define TRACE_FLAG_DOWNSAMPLE 1
+// The points of TRACE_BUILD or TRACE_ADD_POINTS are followed by their time
+#define TRACE_FLAG_TIMED 2
+
+enum trace_operation_set
+{
+    TRACE_BUILD,
+    TRACE_ADD_POINTS,
+    TRACE_DELETE_POINTS,
+    TRACE_ADD_BOXES,
+    TRACE_DELETE_BOXES,
+    TRACE_NEAREST_SEARCH,
+    TRACE_BOX_SEARCH,
+    TRACE_RADIUS_SEARCH,
+    TRACE_DELETE_BY_ID,
+    TRACE_CROP_BOX,
+    // Since version 3
+    TRACE_RADIUS_SEARCH_CAPPED,
+    TRACE_DELETE_OLDER,
+    TRACE_NEAREST_SEARCH_RECENT,
+    TRACE_COMPACT,
+    // Since version 4
+    TRACE_MERGE,
+    TRACE_SET_TRANSFORM,
+    TRACE_REBAKE,
+    TRACE_NEAREST_PLANE,
+    TRACE_NEAREST_PLANE_BATCH
+};
+
+struct KD_TREE_Trace_Header
+{
+    uint32_t magic;
+    uint32_t version;
+    float delete_param;
+    float balance_param;
+    float box_length;
+    uint32_t dimension;
+};
+
+struct KD_TREE_Trace_Record
+{
+    uint8_t op;
+    // TRACE_FLAG_* bits
+    uint8_t flag;
+    uint16_t reserved;
+    uint32_t num;
+    // Nanoseconds since start_trace
+    int64_t timestamp;
+    // k_nearest, max_dist, epsilon and max_visit for TRACE_NEAREST_SEARCH, k_nearest and max_dist for
+    // TRACE_NEAREST_SEARCH_RECENT, k_nearest, max_dist and max_residual for TRACE_NEAREST_PLANE(_BATCH), radius for
+    // TRACE_RADIUS_SEARCH, radius and max_num for TRACE_RADIUS_SEARCH_CAPPED, max_points and min_invalid_ratio for
+    // TRACE_COMPACT. Records of versions before 4 end after param[1].
+    float param[4];
+};
+
+template <typename PointType, int DIM = 3, typename PointStorage = KD_TREE_Full_Storage<PointType, DIM>>
 class KD_TREE
 {
     // using MANUAL_Q_ = MANUAL_Q<typename PointType>;
@@ -61,11 +483,18 @@ class KD_TREE
     // using MANUAL_Q_ = MANUAL_Q<typename PointType>;
 public:
     using PointVector = std::vector<PointType, Eigen::aligned_allocator<PointType>>;
-    using Ptr = std::shared_ptr<KD_TREE<PointType>>;
-    
+    using Ptr = std::shared_ptr<KD_TREE<PointType, DIM, PointStorage>>;
+    using Traits = KD_TREE_Point_Traits<PointType>;
+    using StoredPoint = typename PointStorage::Type;
+    using BoxPointType = KD_TREE_Box<DIM>;
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+    struct Node_Block;
     struct KD_TREE_NODE
     {
-        PointType point;
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+        StoredPoint point;
+        uint32_t point_id = INVALID_POINT_ID;
         int division_axis;
         int TreeSize = 1;
         int invalid_point_num = 0;
@@ -77,39 +506,109 @@ public:
         bool need_push_down_to_left = false;
         bool need_push_down_to_right = false;
         bool working_flag = false;
-        pthread_mutex_t push_down_mutex_lock;
-        float node_range_x[2], node_range_y[2], node_range_z[2];
+        // Generation of the tree the node was created in, nodes older than the newest live snapshot are shared with it
+        uint32_t generation;
+        float node_range[DIM][2];
         float radius_sq;
         KD_TREE_NODE *left_son_ptr = nullptr;
         KD_TREE_NODE *right_son_ptr = nullptr;
         KD_TREE_NODE *father_ptr = nullptr;
+        // Allocation shared with the nodes built in the same BuildTree call, nullptr for a node added on its own
+        Node_Block *block = nullptr;
+#if MOMENTS_SWITCH
+        // Mean and scatter matrix (upper triangle of the sum of (p - mean)(p - mean)^T) of the first three axes of
+        // all points below, deleted ones included
+        float moment_mean[3];
+        float moment_scatter[6];
+#endif
+#if TIMESTAMP_SWITCH
+        // Time the point was added and the range of the times below, over the valid points like node_range
+        double point_time;
+        double time_range[2];
+#endif
         // For paper data record
         float alpha_del;
         float alpha_bal;
     };
 
+    // Nodes built together by BuildTree live in one array, which is freed with the last of its nodes
+    struct Node_Block
+    {
+        KD_TREE_NODE *nodes;
+        atomic<int> live_num;
+    };
+
+    // Subtree left to build: the range [l, r] of the storage goes below link, depth counts the levels within the current group
+    struct Build_Task
+    {
+        KD_TREE_NODE **link;
+        int l, r;
+        int depth;
+    };
+
+    // Path from the root (bit i set: right son at level i) to a small subtree around the last query, filled in by the
+    // search itself. It is followed from the root again on every use, so rebuilds in between can make it less
+    // useful but never give a wrong result.
+    struct Search_Hint
+    {
+        uint64_t path = 0;
+        int depth = 0;
+    };
+
+    // Least-squares plane through the k nearest points of a query, normal . p + d = 0 with a unit normal. residual is
+    // the largest distance of the points from the plane, valid is set if k points were found and residual is small enough.
+    struct Plane_Fit
+    {
+        float normal[3] = {0.0f, 0.0f, 0.0f};
+        float d = 0.0f;
+        float residual = INFINITY;
+        int num = 0;
+        bool valid = false;
+    };
+
     struct Operation_Logger_Type
     {
-        PointType point;
+        StoredPoint point;
+        uint32_t point_id;
+        // Location of point_id for DELETE_POINT_ID, copied when logged: the id table is only read by the writer
+        float id_coordinate[DIM];
+#if TIMESTAMP_SWITCH
+        // Time of the added point, or the threshold of DELETE_OLDER
+        double point_time;
+#endif
         BoxPointType boxpoint;
         bool tree_deleted, tree_downsample_deleted;
         operation_set op;
     };
     // static const PointType zeroP;
 
+    // A stored point with the id it received on insertion, used to carry ids through rebuilds
+    struct Point_Entry_Type
+    {
+        StoredPoint point;
+        uint32_t point_id;
+#if TIMESTAMP_SWITCH
+        double point_time;
+#endif
+    };
+    using EntryVector = std::vector<Point_Entry_Type, Eigen::aligned_allocator<Point_Entry_Type>>;
+
     struct PointType_CMP
     {
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
         PointType point;
         float dist = 0.0;
-        PointType_CMP(PointType p = PointType(), float d = INFINITY)
+        uint32_t point_id;
+        PointType_CMP(PointType p = PointType(), float d = INFINITY, uint32_t id = INVALID_POINT_ID)
         {
             this->point = p;
             this->dist = d;
+            this->point_id = id;
         };
         bool operator<(const PointType_CMP &a) const
         {
             if (fabs(dist - a.dist) < 1e-10)
-                return point.x < a.point.x;
+                return Traits::get(point, 0) < Traits::get(a.point, 0);
             else
                 return dist < a.dist;
         }
@@ -144,6 +643,10 @@ public:
         {
             return heap[0];
         }
+        const PointType_CMP &at(int heap_index)
+        {
+            return heap[heap_index];
+        }
         void push(PointType_CMP point)
         {
             if (heap_size >= cap)
@@ -211,10 +714,15 @@ public:
     {
     private:
         int head = 0, tail = 0, counter = 0;
-        Operation_Logger_Type q[Q_LEN];
+        // Allocated on the first push, a snapshot view never logs
+        Operation_Logger_Type *q = nullptr;
         bool is_empty;
 
     public:
+        ~MANUAL_Q()
+        {
+            delete[] q;
+        }
         void pop()
         {
             if (counter == 0)
@@ -244,6 +752,8 @@ public:
         }
         void push(Operation_Logger_Type op)
         {
+            if (q == nullptr)
+                q = new Operation_Logger_Type[Q_LEN];
             q[tail] = op;
             counter++;
             if (is_empty)
@@ -261,56 +771,473 @@ public:
         }
     };
 
+    // Labels a Push_Down of the fathers would still write into a node. The searches and flattens carry them down instead
+    // of writing them, so that they never modify a node, which may be shared with a snapshot or read by another search.
+    struct Pending_Labels
+    {
+        bool pushed = false;
+        bool tree_deleted = false;
+        bool tree_downsample_deleted = false;
+    };
+
+    // Pending subtree of an iterative traversal. The node is read through the link it hangs from when the
+    // entry is popped, so that a subtree swapped in by the rebuild thread in the meantime is the one visited.
+    struct Traversal_Entry
+    {
+        KD_TREE_NODE **link;
+        float dist;
+        bool inside;
+        Pending_Labels labels;
+    };
+
+    // Stack of the iterative traversals, kept on the call stack up to Traversal_Stack_Inline_Size entries
+    template <typename T>
+    class MANUAL_STACK
+    {
+    public:
+        MANUAL_STACK()
+        {
+            data = buffer;
+            cap = Traversal_Stack_Inline_Size;
+            stack_size = 0;
+        }
+        ~MANUAL_STACK()
+        {
+            if (data != buffer)
+                delete[] data;
+        }
+        void push(const T &element)
+        {
+            if (stack_size >= cap)
+                Grow();
+            data[stack_size++] = element;
+        }
+        T pop()
+        {
+            return data[--stack_size];
+        }
+        bool empty()
+        {
+            return stack_size == 0;
+        }
+        int size()
+        {
+            return stack_size;
+        }
+
+    private:
+        T buffer[Traversal_Stack_Inline_Size];
+        T *data;
+        int cap;
+        int stack_size;
+        void Grow()
+        {
+            T *new_data = new T[cap * 2];
+            for (int i = 0; i < stack_size; i++)
+                new_data[i] = data[i];
+            if (data != buffer)
+                delete[] data;
+            data = new_data;
+            cap *= 2;
+        }
+    };
+
+    /*
+        Read-only view of the tree as it was when Snapshot was called. It shares the nodes with the tree, which copies a
+        node before modifying it while a snapshot that can reach it is alive. The results are in the map frame of that
+        time. Any number of threads may search a snapshot at once.
+    */
+    class Tree_Snapshot
+    {
+    public:
+        void Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist = INFINITY, float epsilon = 0.0f, int max_visit = 0)
+        {
+            view->Nearest_Search(point, k_nearest, Nearest_Points, Point_Distance, max_dist, epsilon, max_visit);
+        }
+        void Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, Search_Hint &hint, float max_dist = INFINITY)
+        {
+            view->Nearest_Search(point, k_nearest, Nearest_Points, Point_Distance, hint, max_dist);
+        }
+        void Nearest_Search_ID(PointType point, int k_nearest, vector<uint32_t> &Nearest_IDs, vector<float> &Point_Distance, float max_dist = INFINITY, float epsilon = 0.0f, int max_visit = 0)
+        {
+            view->Nearest_Search_ID(point, k_nearest, Nearest_IDs, Point_Distance, max_dist, epsilon, max_visit);
+        }
+        void Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage)
+        {
+            view->Box_Search(Box_of_Point, Storage);
+        }
+        void Box_Search_ID(const BoxPointType &Box_of_Point, vector<uint32_t> &Storage)
+        {
+            view->Box_Search_ID(Box_of_Point, Storage);
+        }
+        void Radius_Search(PointType point, const float radius, PointVector &Storage)
+        {
+            view->Radius_Search(point, radius, Storage);
+        }
+        void Radius_Search(PointType point, const float radius, int max_num, PointVector &Storage, vector<float> &Point_Distance)
+        {
+            view->Radius_Search(point, radius, max_num, Storage, Point_Distance);
+        }
+        void Radius_Search_ID(PointType point, const float radius, vector<uint32_t> &Storage)
+        {
+            view->Radius_Search_ID(point, radius, Storage);
+        }
+        bool Nearest_Plane(PointType point, int k_nearest, Plane_Fit &plane, float max_residual = 0.1f, float max_dist = INFINITY)
+        {
+            return view->Nearest_Plane(point, k_nearest, plane, max_residual, max_dist);
+        }
+        int size()
+        {
+            return view->size();
+        }
+        int validnum()
+        {
+            return view->validnum();
+        }
+        BoxPointType tree_range()
+        {
+            return view->tree_range();
+        }
+
+    private:
+        friend class KD_TREE;
+        Tree_Snapshot(KD_TREE *tree_view) : view(tree_view) {}
+        std::unique_ptr<KD_TREE> view;
+    };
+    using Snapshot_Ptr = std::shared_ptr<Tree_Snapshot>;
+
 private:
     // Multi-thread Tree Rebuild
     bool termination_flag = false;
     bool rebuild_flag = false;
-    pthread_t rebuild_thread;
+    pthread_t rebuild_thread = 0;
     pthread_mutex_t termination_flag_mutex_lock, rebuild_ptr_mutex_lock, working_flag_mutex, search_flag_mutex;
     pthread_mutex_t rebuild_logger_mutex_lock, points_deleted_rebuild_mutex_lock;
     // queue<Operation_Logger_Type> Rebuild_Logger;
     MANUAL_Q Rebuild_Logger;
-    PointVector Rebuild_PCL_Storage;
+    EntryVector Rebuild_PCL_Storage;
     KD_TREE_NODE **Rebuild_Ptr = nullptr;
     int search_mutex_counter = 0;
     static void *multi_thread_ptr(void *arg);
     void multi_thread_rebuild();
     void start_thread();
     void stop_thread();
-    void run_operation(KD_TREE_NODE **root, Operation_Logger_Type operation);
+    void run_operation(KD_TREE_NODE **root, Operation_Logger_Type operation, const KD_TREE_Rigid_Transform *bake_transform = nullptr);
+    // Map frame of the stored points. A re-bake rebuilds the tree with the points moved by Bake_Transform on the rebuild
+    // thread, the result waits in Baked_Root until the writer swaps it in. Replaced trees are freed on the rebuild thread.
+    KD_TREE_Rigid_Transform Map_Transform;
+    bool map_transformed = false;
+    bool map_rotated = false;
+    KD_TREE_Rigid_Transform Bake_Transform;
+    bool bake_requested = false;
+    atomic<bool> bake_ready{false};
+    KD_TREE_NODE *Baked_Root = nullptr;
+    int bake_epoch = 0;
+    vector<KD_TREE_NODE *> Discarded_Trees;
+    void finish_rebake();
+    void bake_storage(EntryVector &Storage);
+    bool transform_stored(StoredPoint &point, const KD_TREE_Rigid_Transform &transform);
+    void bake_coordinate(const float *coordinate, float *baked);
+    void transform_point(PointType &point, const KD_TREE_Rigid_Transform &transform, bool inverse) const;
+    PointType to_stored(const PointType &point) const;
+    void to_map(PointType &point) const;
+    void to_map(Plane_Fit &plane) const;
+    void to_map(PointVector &points, size_t begin = 0) const;
+    const KD_TREE_Rigid_Transform *map_box_frame(BoxPointType &box) const;
+    int delete_points_logged(KD_TREE_NODE **root, const BoxPointType &boxpoint, const KD_TREE_Rigid_Transform *box_frame, bool inside);
+    void restore_points_logged(KD_TREE_NODE **root, const BoxPointType &boxpoint, const KD_TREE_Rigid_Transform *box_frame);
+    // Local map window, and the subtrees cut off by Crop_To_Box and pruning box deletes, which are freed on the rebuild thread
+    BoxPointType Map_Window;
+    bool map_window_set = false;
+    // Cut off subtrees with the number of rebakes swapped in before, their points are reported in the frame of the current one
+    vector<pair<KD_TREE_NODE *, int>> Detached_Trees;
+    pthread_mutex_t detached_trees_mutex_lock;
+    int Delete_outside(KD_TREE_NODE **root, const BoxPointType &window, bool allow_rebuild, const KD_TREE_Rigid_Transform *box_frame = nullptr);
+    int delete_outside_logged(KD_TREE_NODE **root, const BoxPointType &window, const KD_TREE_Rigid_Transform *box_frame = nullptr);
+    bool contains_rebuild_root(KD_TREE_NODE *root);
+    KD_TREE_NODE *release_tree();
+    bool graft_subtree(KD_TREE_NODE *guest, KD_TREE_NODE **&graft_link);
+    void trace_merge(const KD_TREE &other, const EntryVector &entries, const vector<uint32_t> &New_IDs);
+    void spatial_order(EntryVector &Storage);
+    // Extract: subtrees inside the box are flattened after the traversal, by up to Extract_Thread_Num threads
+    struct Extract_Task
+    {
+        KD_TREE *tree;
+        vector<KD_TREE_NODE *> subtrees;
+        EntryVector points;
+    };
+    static void *extract_thread_ptr(void *arg);
+    void flatten_subtrees(vector<KD_TREE_NODE *> &Subtrees, EntryVector &Storage);
+    int Extract_by_range(KD_TREE_NODE **root, const BoxPointType &boxpoint, bool allow_rebuild, EntryVector &Storage, vector<KD_TREE_NODE *> &Subtrees, const KD_TREE_Rigid_Transform *box_frame = nullptr);
+    int extract_logged(KD_TREE_NODE **root, const BoxPointType &boxpoint, EntryVector &Storage, vector<KD_TREE_NODE *> &Subtrees, const KD_TREE_Rigid_Transform *box_frame = nullptr);
+    bool detach_subtree(KD_TREE_NODE **root, vector<KD_TREE_NODE *> *Subtrees = nullptr);
+    void free_detached_trees();
+    // Snapshots: a node created before the newest live snapshot may be reachable from it and is never modified. The writer
+    // copies it first (own_node), the copy goes into the tree and the node waits in retired until no snapshot that can
+    // reach it is left. Shared by the tree and its snapshots, so that a snapshot may outlive the tree.
+    struct Snapshot_Registry
+    {
+        pthread_mutex_t mutex_lock;
+        atomic<uint32_t> generation{1};
+        // Generation of the newest live snapshot, 0 if there is none
+        atomic<uint32_t> shared_below{0};
+        multiset<uint32_t> live;
+        vector<KD_TREE_NODE *> retired;
+        Snapshot_Registry()
+        {
+            pthread_mutex_init(&mutex_lock, NULL);
+        }
+        ~Snapshot_Registry()
+        {
+            for (KD_TREE_NODE *node : retired)
+                free_node(node);
+            pthread_mutex_destroy(&mutex_lock);
+        }
+        uint32_t acquire()
+        {
+            pthread_mutex_lock(&mutex_lock);
+            uint32_t snapshot = ++generation;
+            live.insert(snapshot);
+            shared_below = snapshot;
+            pthread_mutex_unlock(&mutex_lock);
+            return snapshot;
+        }
+        void release(uint32_t snapshot)
+        {
+            pthread_mutex_lock(&mutex_lock);
+            live.erase(live.find(snapshot));
+            shared_below = live.empty() ? 0 : *live.rbegin();
+            size_t kept_num = 0;
+            for (KD_TREE_NODE *node : retired)
+            {
+                if (node->generation < shared_below)
+                    retired[kept_num++] = node;
+                else
+                    free_node(node);
+            }
+            retired.resize(kept_num);
+            pthread_mutex_unlock(&mutex_lock);
+        }
+    };
+    shared_ptr<Snapshot_Registry> snapshots;
+    // Set in a snapshot view, which only searches and releases its generation when destroyed. A view holds the root, the
+    // map frame and the storage of the tree, it has no rebuild thread and never takes a lock of its own.
+    uint32_t snapshot_generation = 0;
+    KD_TREE(KD_TREE &tree, uint32_t snapshot);
+    bool shared_node(const KD_TREE_NODE *node) const
+    {
+        return node->generation < snapshots->shared_below.load(memory_order_relaxed);
+    }
+    void own_node(KD_TREE_NODE **link);
+    void clone_node(KD_TREE_NODE **link);
+    // Concurrent readers: searches on other threads than writer_thread go to Published, a snapshot replaced whenever a
+    // call of the writer returns
+    bool concurrent_readers = false;
+    pthread_t writer_thread;
+    pthread_mutex_t published_mutex_lock;
+    Snapshot_Ptr Published;
+    void publish();
+    KD_TREE *published_view(Snapshot_Ptr &published);
+    // Modifying calls hold writer_mutex_lock (recursive) so that the ingestion thread and the caller's own updates take
+    // turns. The outermost one publishes.
+    pthread_mutex_t writer_mutex_lock;
+    int writer_depth = 0;
+    struct Writer_Guard
+    {
+        KD_TREE *tree;
+        Writer_Guard(KD_TREE *writer) : tree(writer)
+        {
+            pthread_mutex_lock(&tree->writer_mutex_lock);
+        }
+        ~Writer_Guard()
+        {
+            pthread_mutex_unlock(&tree->writer_mutex_lock);
+        }
+    };
+    struct Publish_Guard
+    {
+        Writer_Guard writer_guard;
+        KD_TREE *tree;
+        Publish_Guard(KD_TREE *writer) : writer_guard(writer), tree(writer)
+        {
+            tree->writer_depth++;
+        }
+        ~Publish_Guard()
+        {
+            if (tree->writer_depth == 1 && tree->concurrent_readers)
+                tree->publish();
+            tree->writer_depth--;
+        }
+    };
+    // Ingestion queue: batches of points waiting for the ingestion thread, which applies all of those queued at once.
+    // Sequence numbers count the batches enqueued and applied.
+    struct Ingestion_Batch
+    {
+        PointVector points;
+        bool downsample_on;
+        double timestamp;
+    };
+    vector<Ingestion_Batch> Ingestion_Queue;
+    uint64_t ingestion_enqueued = 0;
+    uint64_t ingestion_applied = 0;
+    bool ingestion_termination_flag = false;
+    pthread_t ingestion_thread = 0;
+    pthread_mutex_t ingestion_mutex_lock;
+    pthread_cond_t ingestion_queued_cond, ingestion_space_cond, ingestion_applied_cond;
+    static void *ingestion_ptr(void *arg);
+    void ingestion_loop();
+    void start_ingestion();
+    void stop_ingestion();
+    uint64_t enqueue_points(PointVector &PointToAdd, bool downsample_on, double timestamp);
+    // Operation trace
+    FILE *trace_file = nullptr;
+    pthread_mutex_t trace_mutex_lock;
+    chrono::steady_clock::time_point trace_start_time;
+    void record_trace(trace_operation_set op, int flag, float param_0, float param_1, float param_2, float param_3, const PointType *points, int point_num, const BoxPointType *boxes, int box_num, const double *time = nullptr, const uint32_t *ids = nullptr, int id_num = 0, int time_num = 1, const KD_TREE_Rigid_Transform *transform = nullptr);
+    void lock_search_shared();
+    void unlock_search_shared();
+    void lock_search_exclusive();
+    void unlock_search_exclusive();
+    void enter_subtree(KD_TREE_NODE **link, int stack_size, int &locked_size);
+    void leave_subtree(int stack_size, int &locked_size);
+#if METRICS_SWITCH
+    // Metrics
+    pthread_mutex_t metrics_mutex_lock;
+    KD_TREE_Metrics metrics;
+    // Per thread, searches of a snapshot may run on several threads
+    static thread_local int search_visited_counter;
+    void record_metrics(KD_TREE_Histogram &histogram, chrono::high_resolution_clock::time_point start_time);
+#endif
     // KD Tree Functions and augmented variables
     int Treesize_tmp = 0, Validnum_tmp = 0;
     float alpha_bal_tmp = 0.5, alpha_del_tmp = 0.0;
     float delete_criterion_param = 0.5f;
     float balance_criterion_param = 0.7f;
     float downsample_size = 0.2f;
+    int prune_min_size = 0;
     bool Delete_Storage_Disabled = false;
     KD_TREE_NODE *STATIC_ROOT_NODE = nullptr;
     PointVector Points_deleted;
-    PointVector Downsample_Storage;
+    EntryVector Downsample_Storage;
+    EntryVector Rebuild_Entry_Storage;
+    // Point ids: coordinates (DIM floats) of the ids handed out, used to locate the node in Delete_By_Id, in pages of
+    // ID_Page_Size ids. Once as many ids were handed out since the last sweep as the tree has nodes, Add_Points releases
+    // the pages none of whose points is left in the tree. Ids are not reused, once the 32-bit ids run out points are added
+    // with INVALID_POINT_ID.
+    uint32_t next_point_id = 0;
+    bool point_ids_exhausted = false;
+    vector<vector<float>> ID_Pages;
+    uint32_t id_sweep_mark = 0;
+    uint32_t assign_point_id(const StoredPoint &point);
+    const float *id_coordinate(uint32_t point_id) const;
+    void clear_point_ids();
+    void sweep_point_ids();
     PointVector Multithread_Points_deleted;
     void InitTreeNode(KD_TREE_NODE *root);
     void Test_Lock_States(KD_TREE_NODE *root);
-    void BuildTree(KD_TREE_NODE **root, int l, int r, PointVector &Storage);
+    // Bodies of the Build and Add_Points overloads, points without a time get INFINITY
+    void build_points(PointVector &point_cloud, double timestamp);
+    int add_points(PointVector &PointToAdd, bool downsample_on, vector<uint32_t> &Point_IDs, double timestamp);
+    void BuildTree(KD_TREE_NODE **root, int l, int r, EntryVector &Storage);
     void Rebuild(KD_TREE_NODE **root);
-    int Delete_by_range(KD_TREE_NODE **root, BoxPointType boxpoint, bool allow_rebuild, bool is_downsample);
-    void Delete_by_point(KD_TREE_NODE **root, PointType point, bool allow_rebuild);
-    void Add_by_point(KD_TREE_NODE **root, PointType point, bool allow_rebuild, int father_axis);
-    void Add_by_range(KD_TREE_NODE **root, BoxPointType boxpoint, bool allow_rebuild);
-    void Search(KD_TREE_NODE *root, int k_nearest, PointType point, MANUAL_HEAP &q, float max_dist); //priority_queue<PointType_CMP>
-    void Search_by_range(KD_TREE_NODE *root, BoxPointType boxpoint, PointVector &Storage);
-    void Search_by_radius(KD_TREE_NODE *root, PointType point, float radius, PointVector &Storage);
+    // box_frame, if given, maps the stored points into the frame of the box
+    int Delete_by_range(KD_TREE_NODE **root, BoxPointType boxpoint, bool allow_rebuild, bool is_downsample, const KD_TREE_Rigid_Transform *box_frame = nullptr);
+    int Compact_by_ratio(KD_TREE_NODE **root, int max_points, float min_invalid_ratio);
+    int Delete_by_time(KD_TREE_NODE **root, double min_time, bool allow_rebuild);
+    void Delete_by_point(KD_TREE_NODE **root, StoredPoint point, bool allow_rebuild);
+    void Add_by_point(KD_TREE_NODE **root, StoredPoint point, uint32_t point_id, double point_time, bool allow_rebuild, int father_axis);
+    bool Delete_by_id(KD_TREE_NODE **root, const float *coordinate, uint32_t point_id, bool allow_rebuild);
+    void Add_by_range(KD_TREE_NODE **root, BoxPointType boxpoint, bool allow_rebuild, const KD_TREE_Rigid_Transform *box_frame = nullptr);
+    void Search(KD_TREE_NODE **root, int k_nearest, PointType point, MANUAL_HEAP &q, float max_dist, float prune_scale, int &visit_budget, KD_TREE_NODE *skip_root = nullptr, double min_time = -INFINITY, Pending_Labels labels = Pending_Labels()); //priority_queue<PointType_CMP>
+    void Search_Root(PointType point, int k_nearest, MANUAL_HEAP &q, float max_dist, float epsilon, int max_visit, Search_Hint *hint = nullptr, double min_time = -INFINITY);
+    // Labels of node after the Push_Down of its fathers, and the ones it would push into its sons
+    struct Node_Labels
+    {
+        bool tree_deleted;
+        bool point_deleted;
+        bool point_downsample_deleted;
+        int invalid_point_num;
+        Pending_Labels left, right;
+    };
+    void read_labels(const KD_TREE_NODE *node, const Pending_Labels &pending, Node_Labels &labels) const
+    {
+        if (pending.pushed)
+        {
+            bool tree_downsample_deleted = node->tree_downsample_deleted || pending.tree_downsample_deleted;
+            labels.point_downsample_deleted = node->point_downsample_deleted || pending.tree_downsample_deleted;
+            labels.tree_deleted = pending.tree_deleted || tree_downsample_deleted;
+            labels.point_deleted = labels.tree_deleted || labels.point_downsample_deleted;
+            int down_del_num = pending.tree_downsample_deleted ? node->TreeSize : node->down_del_num;
+            labels.invalid_point_num = pending.tree_deleted ? node->TreeSize : down_del_num;
+            labels.left = Pending_Labels{true, labels.tree_deleted, tree_downsample_deleted};
+            labels.right = labels.left;
+            return;
+        }
+        labels.tree_deleted = node->tree_deleted;
+        labels.point_deleted = node->point_deleted;
+        labels.point_downsample_deleted = node->point_downsample_deleted;
+        labels.invalid_point_num = node->invalid_point_num;
+        labels.left = Pending_Labels{node->need_push_down_to_left, node->tree_deleted, node->tree_downsample_deleted};
+        labels.right = Pending_Labels{node->need_push_down_to_right, node->tree_deleted, node->tree_downsample_deleted};
+    }
+    bool ball_inside(const float cell[][2], const PointType &point, float radius);
+    void fit_plane(MANUAL_HEAP &q, int k_nearest, const PointType &point, float max_residual, Plane_Fit &plane);
+    void update_moments(KD_TREE_NODE *root);
+    template <typename StorageType>
+    void Search_by_range(KD_TREE_NODE **root, BoxPointType boxpoint, StorageType &Storage, const KD_TREE_Rigid_Transform *box_frame = nullptr, vector<KD_TREE_NODE *> *Subtrees = nullptr);
+    template <typename StorageType>
+    void Search_by_radius(KD_TREE_NODE **root, PointType point, float radius, StorageType &Storage);
+    template <typename StorageType>
+    void flatten_storage(KD_TREE_NODE *root, StorageType &Storage, delete_point_storage_set storage_type);
+    void push_storage(PointVector &Storage, KD_TREE_NODE *node);
+    void push_storage(EntryVector &Storage, KD_TREE_NODE *node);
+    void push_storage(vector<uint32_t> &Storage, KD_TREE_NODE *node);
     bool Criterion_Check(KD_TREE_NODE *root);
     void Push_Down(KD_TREE_NODE *root);
     void Update(KD_TREE_NODE *root);
     void delete_tree_nodes(KD_TREE_NODE **root);
+    static void free_node(KD_TREE_NODE *node);
     void downsample(KD_TREE_NODE **root);
-    bool same_point(PointType a, PointType b);
-    float calc_dist(PointType a, PointType b);
+    bool same_point(const StoredPoint &a, const StoredPoint &b);
+    float calc_dist(const StoredPoint &a, const PointType &b);
     float calc_box_dist(KD_TREE_NODE *node, PointType point);
-    static bool point_cmp_x(PointType a, PointType b);
-    static bool point_cmp_y(PointType a, PointType b);
-    static bool point_cmp_z(PointType a, PointType b);
+    bool box_outside(const BoxPointType &boxpoint, const KD_TREE_NODE *node, const KD_TREE_Rigid_Transform *box_frame = nullptr);
+    bool box_contains(const BoxPointType &boxpoint, const KD_TREE_NODE *node, const KD_TREE_Rigid_Transform *box_frame = nullptr);
+    bool box_contains_point(const BoxPointType &boxpoint, const StoredPoint &point, const KD_TREE_Rigid_Transform *box_frame = nullptr);
+    void frame_range(const float range[][2], const KD_TREE_Rigid_Transform &frame, float frame_range[][2]);
+    // Shared with the snapshot views, which decode the points of their nodes with it. Only the writer encodes new points.
+    shared_ptr<PointStorage> point_storage = make_shared<PointStorage>();
+    // Both cache lines read by the search: the point and flags, then the range and child pointers
+    void prefetch_node(const KD_TREE_NODE *node) const
+    {
+#if PREFETCH_SWITCH && defined(__GNUC__)
+        if (node != nullptr)
+        {
+            __builtin_prefetch(node);
+            __builtin_prefetch(&node->node_range);
+        }
+#endif
+    }
+    float point_value(const StoredPoint &point, int axis) const
+    {
+        return point_storage->get(point, axis);
+    }
+    PointType decode_point(const StoredPoint &point) const
+    {
+        PointType decoded;
+        point_storage->decode(point, decoded);
+        return decoded;
+    }
+    struct Point_Axis_CMP
+    {
+        const PointStorage *storage;
+        int axis;
+        Point_Axis_CMP(const PointStorage *point_storage, int division_axis) : storage(point_storage), axis(division_axis) {}
+        bool operator()(const Point_Entry_Type &a, const Point_Entry_Type &b) const
+        {
+            return storage->get(a.point, axis) < storage->get(b.point, axis);
+        }
+    };
 
 public:
     KD_TREE(float delete_param = 0.5, float balance_param = 0.6, float box_length = 0.2);
@@ -327,18 +1254,119 @@ public:
     {
         downsample_size = downsample_param;
     }
+    // Subtrees of at least prune_size points covered by a box delete are cut off and freed on the rebuild thread instead of
+    // labeled deleted, 0 (the default) keeps them until the next rebuild
+    void set_prune_param(int prune_size)
+    {
+        prune_min_size = prune_size;
+    }
+    // Quantization step of KD_TREE_Quantized_Storage, to be set before the first point is added
+    bool set_quantization_param(float quantum)
+    {
+        return point_storage->set_quantum(quantum);
+    }
     void InitializeKDTree(float delete_param = 0.5, float balance_param = 0.7, float box_length = 0.2);
     int size();
     int validnum();
     void root_alpha(float &alpha_bal, float &alpha_del);
+    void acquire_metrics(KD_TREE_Metrics &metrics_snapshot);
+    void reset_metrics();
+    bool start_trace(const char *filename);
+    void stop_trace();
     void Build(PointVector point_cloud);
-    void Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist = INFINITY);
+#if TIMESTAMP_SWITCH
+    // Points added with a time can be removed by age, points added without one never expire
+    void Build(PointVector point_cloud, double timestamp);
+#endif
+    // With epsilon > 0 a subtree is skipped unless it may hold a point closer than the current k-th distance / (1 + epsilon),
+    // every returned distance is then within (1 + epsilon) of the true one. max_visit > 0 stops the search after that many nodes.
+    void Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist = INFINITY, float epsilon = 0.0f, int max_visit = 0);
+#if TIMESTAMP_SWITCH
+    // k-nearest search among the points added at min_time or later, subtrees with only older points are skipped
+    void Nearest_Search_Recent(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, double min_time, float max_dist = INFINITY);
+#endif
     void Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage);
     void Radius_Search(PointType point, const float radius, PointVector &Storage);
+    // The max_num points closest to point within radius, sorted by squared distance. Searches for no point (k_nearest or
+    // max_num <= 0) return nothing.
+    void Radius_Search(PointType point, const float radius, int max_num, PointVector &Storage, vector<float> &Point_Distance);
+    // Same searches returning the ids of the points instead of copies
+    void Nearest_Search_ID(PointType point, int k_nearest, vector<uint32_t> &Nearest_IDs, vector<float> &Point_Distance, float max_dist = INFINITY, float epsilon = 0.0f, int max_visit = 0);
+    // Exact searches starting from the subtree in hint, which is updated for the next query
+    void Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, Search_Hint &hint, float max_dist = INFINITY);
+    void Nearest_Search_ID(PointType point, int k_nearest, vector<uint32_t> &Nearest_IDs, vector<float> &Point_Distance, Search_Hint &hint, float max_dist = INFINITY);
+    void Box_Search_ID(const BoxPointType &Box_of_Point, vector<uint32_t> &Storage);
+    // k-nearest search and plane fit in one call, without copying the neighbors out (3D trees only)
+    bool Nearest_Plane(PointType point, int k_nearest, Plane_Fit &plane, float max_residual = 0.1f, float max_dist = INFINITY);
+    // Same for every point of a scan, returns the number of valid planes
+    int Nearest_Plane_Batch(const PointVector &points, int k_nearest, vector<Plane_Fit> &planes, float max_residual = 0.1f, float max_dist = INFINITY);
+    // Plane of the smallest subtree around point with at least min_points points, none of them deleted, from the cached
+    // moments (MOMENTS_SWITCH). residual is the RMS distance from the plane. Falls back to a min_points-nearest fit
+    // within max_radius if no such subtree of at most max_radius exists.
+    bool Plane_Lookup(PointType point, int min_points, Plane_Fit &plane, float max_residual = 0.1f, float max_radius = 1.0f);
+    void Radius_Search_ID(PointType point, const float radius, vector<uint32_t> &Storage);
+    void Radius_Search_ID(PointType point, const float radius, int max_num, vector<uint32_t> &Storage, vector<float> &Point_Distance);
     int Add_Points(PointVector &PointToAdd, bool downsample_on);
+    int Add_Points(PointVector &PointToAdd, bool downsample_on, vector<uint32_t> &Point_IDs);
+#if TIMESTAMP_SWITCH
+    // All points are stamped with timestamp, a map point kept by the downsample takes the new time
+    int Add_Points(PointVector &PointToAdd, bool downsample_on, double timestamp);
+    int Add_Points(PointVector &PointToAdd, bool downsample_on, vector<uint32_t> &Point_IDs, double timestamp);
+#endif
+    int Delete_By_Id(vector<uint32_t> &PointIDs);
     void Add_Point_Boxes(vector<BoxPointType> &BoxPoints);
     void Delete_Points(PointVector &PointToDel);
     int Delete_Point_Boxes(vector<BoxPointType> &BoxPoints);
+    // Rebuilds the subtrees with at least min_invalid_ratio deleted points, up to max_points points in total, to be called
+    // when the caller is idle. Subtrees of Multi_Thread_Rebuild_Point_Num points or more go to the rebuild thread.
+    int Compact(int max_points, float min_invalid_ratio = 0.2f);
+#if TIMESTAMP_SWITCH
+    // Removes every point added before min_time, subtrees with only older points are labeled (or, with pruning, cut off) at once
+    int Delete_Older_Than(double min_time);
+#endif
+    // Removes every point outside window in one pass, subtrees entirely outside are cut off and freed on the rebuild thread
+    int Crop_To_Box(const BoxPointType &window);
+    // Local map of half_length around the sensor on every axis. Once the sensor comes within move_threshold of a face of
+    // the window, the window is centered on the sensor again and the points that left it are removed.
+    int Update_Map_Window(PointType sensor, float half_length, float move_threshold);
+    // Moves the valid points of other into this tree and leaves other empty, returns their number. The larger tree's nodes
+    // are kept and the smaller one is grafted under its point nearest to the larger one if their ranges are disjoint,
+    // otherwise its points are inserted. Points of this tree keep their ids, New_IDs[old id] is the new id of a point of other.
+    int Merge(KD_TREE &&other);
+    int Merge(KD_TREE &&other, vector<uint32_t> &New_IDs);
+    // Replaces the content of region, as Build does, by the points inside box and returns their number. With remove they
+    // are deleted from this tree in the same pass. Subtrees inside the box are taken whole and flattened in parallel.
+    int Extract(const BoxPointType &box, KD_TREE &region, bool remove = false);
+    // O(1) read-only view of the tree as it is now, for readers on other threads while the writer goes on. Nodes replaced
+    // or removed meanwhile are freed once the last snapshot that can reach them is released. Called by the writer.
+    Snapshot_Ptr Snapshot();
+    // Lets any number of threads search the tree while the calling thread, the only one to modify it, goes on. Their
+    // searches are answered from a snapshot published at the end of every modifying call, the writer's own searches
+    // read the tree. To be set before the readers start.
+    void Set_Concurrent_Readers(bool enable);
+    // Queues a copy of the points for the ingestion thread, started by the first call, and returns at once with the
+    // sequence number of the batch. Blocks only while Ingestion_Queue_Capacity batches are waiting. The ingestion thread
+    // becomes the writer of the concurrent readers mode, searches from any other thread go to the published snapshot.
+    uint64_t Enqueue_Points(PointVector &PointToAdd, bool downsample_on);
+#if TIMESTAMP_SWITCH
+    uint64_t Enqueue_Points(PointVector &PointToAdd, bool downsample_on, double timestamp);
+#endif
+    // Waits until the batch with this sequence number, and every earlier one, is in the tree and visible to searches
+    void Wait_For(uint64_t sequence);
+    // Waits until every batch enqueued so far is in the tree
+    void Flush();
+    // Frame of the map (3D trees only): map point = transform * stored point. Queries, added and deleted points and boxes are
+    // given in the map frame and mapped through the inverse, results are mapped back, so a loop closure correction is O(1).
+    bool Set_Map_Transform(const KD_TREE_Rigid_Transform &transform);
+    // Moves the whole map by correction, map point = correction * map point
+    bool Apply_Map_Transform(const KD_TREE_Rigid_Transform &correction);
+    KD_TREE_Rigid_Transform Get_Map_Transform()
+    {
+        return Map_Transform;
+    }
+    // Rebuilds the tree with the points stored in the map frame, on the rebuild thread for large trees while queries and
+    // updates go on. The rebuilt tree is swapped in by a later Add_Points or transform call. False if a rebake is pending.
+    bool Rebake();
     void flatten(KD_TREE_NODE *root, PointVector &Storage, delete_point_storage_set storage_type);
     void acquire_removed_points(PointVector &removed_points);
     BoxPointType tree_range();
@@ -347,5 +1375,13 @@ public:
     int max_queue_size = 0;
 };
 
-// template <typename PointType>
-// PointType KD_TREE<PointType>::zeroP = PointType(0,0,0);
+
+/*
+    The member definitions live in ikd_Tree_impl.hpp. ikd_Tree.cpp instantiates the tree for
+    the PCL point types and Eigen::Vector3f; define KD_TREE_HEADER_ONLY to compile it into the
+    including translation unit instead, for other point types or to let the compiler inline
+    the search kernels into the caller.
+*/
+#ifdef KD_TREE_HEADER_ONLY
+#include "ikd_Tree_impl.hpp"
+#endif
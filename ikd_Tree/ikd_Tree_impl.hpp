@@ -0,0 +1,4556 @@
+#pragma once
+#include "ikd_Tree.h"
+
+/*
+Description: ikd-Tree: an incremental k-d tree for robotic applications 
+Author: Yixi Cai
+email: yixicai@connect.hku.hk
+*/
+
+template <typename PointType, int DIM, typename PointStorage>
+KD_TREE<PointType, DIM, PointStorage>::KD_TREE(float delete_param, float balance_param, float box_length)
+{
+    delete_criterion_param = delete_param;
+    balance_criterion_param = balance_param;
+    downsample_size = box_length;
+    Rebuild_Logger.clear();
+    termination_flag = false;
+    snapshots = make_shared<Snapshot_Registry>();
+    start_thread();
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+KD_TREE<PointType, DIM, PointStorage>::KD_TREE(KD_TREE &tree, uint32_t snapshot) : point_storage(tree.point_storage)
+{
+    // Snapshot view: the searches need the root, the storage and the map frame. Nothing is copied but these.
+    Map_Transform = tree.Map_Transform;
+    map_transformed = tree.map_transformed;
+    map_rotated = tree.map_rotated;
+    Root_Node = tree.Root_Node;
+    snapshots = tree.snapshots;
+    snapshot_generation = snapshot;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+KD_TREE<PointType, DIM, PointStorage>::~KD_TREE()
+{
+    if (snapshot_generation != 0)
+    {
+        // The nodes belong to the tree, retired ones are freed with the last snapshot that can reach them
+        Root_Node = nullptr;
+        snapshots->release(snapshot_generation);
+        return;
+    }
+    stop_ingestion();
+    stop_trace();
+    stop_thread();
+    Published.reset();
+    Delete_Storage_Disabled = true;
+    delete_tree_nodes(&Root_Node);
+    if (Baked_Root != nullptr)
+        delete_tree_nodes(&Baked_Root);
+    PointVector().swap(PCL_Storage);
+    Rebuild_Logger.clear();
+}
+
+
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::InitializeKDTree(float delete_param, float balance_param, float box_length)
+{
+    Set_delete_criterion_param(delete_param);
+    Set_balance_criterion_param(balance_param);
+    set_downsample_param(box_length);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::InitTreeNode(KD_TREE_NODE *root)
+{
+    root->point = StoredPoint();
+    memset(root->node_range, 0, sizeof(root->node_range));
+    root->radius_sq = 0.0f;
+    root->division_axis = 0;
+    root->father_ptr = nullptr;
+    root->left_son_ptr = nullptr;
+    root->right_son_ptr = nullptr;
+    root->TreeSize = 0;
+    root->invalid_point_num = 0;
+    root->down_del_num = 0;
+    root->point_deleted = false;
+    root->tree_deleted = false;
+    root->need_push_down_to_left = false;
+    root->need_push_down_to_right = false;
+    root->point_downsample_deleted = false;
+    root->working_flag = false;
+    root->generation = snapshots->generation.load(memory_order_relaxed);
+#if TIMESTAMP_SWITCH
+    root->point_time = INFINITY;
+    root->time_range[0] = INFINITY;
+    root->time_range[1] = -INFINITY;
+#endif
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::size()
+{
+    Snapshot_Ptr published;
+    if (KD_TREE *view = published_view(published))
+        return view->size();
+    int s = 0;
+    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+    {
+        if (Root_Node != nullptr)
+        {
+            return Root_Node->TreeSize;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+    else
+    {
+        if (!pthread_mutex_trylock(&working_flag_mutex))
+        {
+            s = Root_Node->TreeSize;
+            pthread_mutex_unlock(&working_flag_mutex);
+            return s;
+        }
+        else
+        {
+            return Treesize_tmp;
+        }
+    }
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+typename KD_TREE<PointType, DIM, PointStorage>::BoxPointType KD_TREE<PointType, DIM, PointStorage>::tree_range()
+{
+    Snapshot_Ptr published;
+    if (KD_TREE *view = published_view(published))
+        return view->tree_range();
+    BoxPointType range;
+    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+    {
+        if (Root_Node != nullptr)
+        {
+            for (int i = 0; i < DIM; i++)
+            {
+                range.vertex_min[i] = Root_Node->node_range[i][0];
+                range.vertex_max[i] = Root_Node->node_range[i][1];
+            }
+        }
+        else
+        {
+            memset(&range, 0, sizeof(range));
+        }
+    }
+    else
+    {
+        if (!pthread_mutex_trylock(&working_flag_mutex))
+        {
+            for (int i = 0; i < DIM; i++)
+            {
+                range.vertex_min[i] = Root_Node->node_range[i][0];
+                range.vertex_max[i] = Root_Node->node_range[i][1];
+            }
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+        else
+        {
+            memset(&range, 0, sizeof(range));
+        }
+    }
+    if (map_transformed)
+    {
+        float stored_range[DIM][2], map_range[DIM][2];
+        for (int i = 0; i < DIM; i++)
+        {
+            stored_range[i][0] = range.vertex_min[i];
+            stored_range[i][1] = range.vertex_max[i];
+        }
+        frame_range(stored_range, Map_Transform, map_range);
+        for (int i = 0; i < DIM; i++)
+        {
+            range.vertex_min[i] = map_range[i][0];
+            range.vertex_max[i] = map_range[i][1];
+        }
+    }
+    return range;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::validnum()
+{
+    Snapshot_Ptr published;
+    if (KD_TREE *view = published_view(published))
+        return view->validnum();
+    int s = 0;
+    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+    {
+        if (Root_Node != nullptr)
+            return (Root_Node->TreeSize - Root_Node->invalid_point_num);
+        else
+            return 0;
+    }
+    else
+    {
+        if (!pthread_mutex_trylock(&working_flag_mutex))
+        {
+            s = Root_Node->TreeSize - Root_Node->invalid_point_num;
+            pthread_mutex_unlock(&working_flag_mutex);
+            return s;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::root_alpha(float &alpha_bal, float &alpha_del)
+{
+    Snapshot_Ptr published;
+    if (KD_TREE *view = published_view(published))
+    {
+        view->root_alpha(alpha_bal, alpha_del);
+        return;
+    }
+    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+    {
+        alpha_bal = Root_Node->alpha_bal;
+        alpha_del = Root_Node->alpha_del;
+        return;
+    }
+    else
+    {
+        if (!pthread_mutex_trylock(&working_flag_mutex))
+        {
+            alpha_bal = Root_Node->alpha_bal;
+            alpha_del = Root_Node->alpha_del;
+            pthread_mutex_unlock(&working_flag_mutex);
+            return;
+        }
+        else
+        {
+            alpha_bal = alpha_bal_tmp;
+            alpha_del = alpha_del_tmp;
+            return;
+        }
+    }
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::acquire_metrics(KD_TREE_Metrics &metrics_snapshot)
+{
+#if METRICS_SWITCH
+    pthread_mutex_lock(&metrics_mutex_lock);
+    metrics_snapshot = metrics;
+    pthread_mutex_unlock(&metrics_mutex_lock);
+    pthread_mutex_lock(&rebuild_logger_mutex_lock);
+    metrics_snapshot.rebuild_logger_size = Rebuild_Logger.size();
+    pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+#else
+    metrics_snapshot = KD_TREE_Metrics();
+#endif
+    return;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::reset_metrics()
+{
+#if METRICS_SWITCH
+    pthread_mutex_lock(&metrics_mutex_lock);
+    metrics = KD_TREE_Metrics();
+    pthread_mutex_unlock(&metrics_mutex_lock);
+#endif
+    return;
+}
+
+#if METRICS_SWITCH
+template <typename PointType, int DIM, typename PointStorage>
+thread_local int KD_TREE<PointType, DIM, PointStorage>::search_visited_counter = 0;
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::record_metrics(KD_TREE_Histogram &histogram, chrono::high_resolution_clock::time_point start_time)
+{
+    // Snapshot views have no metrics lock, the searches of concurrent readers are not counted
+    if (snapshot_generation != 0)
+        return;
+    auto end_time = chrono::high_resolution_clock::now();
+    uint64_t duration = chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count();
+    pthread_mutex_lock(&metrics_mutex_lock);
+    histogram.record(duration);
+    pthread_mutex_unlock(&metrics_mutex_lock);
+}
+#endif
+
+template <typename PointType, int DIM, typename PointStorage>
+bool KD_TREE<PointType, DIM, PointStorage>::start_trace(const char *filename)
+{
+    stop_trace();
+    FILE *fp = fopen(filename, "wb");
+    if (fp == nullptr)
+        return false;
+    KD_TREE_Trace_Header header;
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.delete_param = delete_criterion_param;
+    header.balance_param = balance_criterion_param;
+    header.box_length = downsample_size;
+    header.dimension = DIM;
+    fwrite(&header, sizeof(header), 1, fp);
+    pthread_mutex_lock(&trace_mutex_lock);
+    trace_start_time = chrono::steady_clock::now();
+    trace_file = fp;
+    pthread_mutex_unlock(&trace_mutex_lock);
+    return true;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::stop_trace()
+{
+    pthread_mutex_lock(&trace_mutex_lock);
+    if (trace_file != nullptr)
+    {
+        fclose(trace_file);
+        trace_file = nullptr;
+    }
+    pthread_mutex_unlock(&trace_mutex_lock);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::record_trace(trace_operation_set op, int flag, float param_0, float param_1, float param_2, float param_3, const PointType *points, int point_num, const BoxPointType *boxes, int box_num, const double *time, const uint32_t *ids, int id_num, int time_num, const KD_TREE_Rigid_Transform *transform)
+{
+    pthread_mutex_lock(&trace_mutex_lock);
+    if (trace_file == nullptr)
+    {
+        pthread_mutex_unlock(&trace_mutex_lock);
+        return;
+    }
+    KD_TREE_Trace_Record record;
+    record.op = op;
+    record.flag = flag;
+    record.reserved = 0;
+    if (transform != nullptr)
+        record.num = 1;
+    else
+        record.num = (ids != nullptr) ? id_num : ((boxes != nullptr) ? box_num : point_num);
+    record.timestamp = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - trace_start_time).count();
+    record.param[0] = param_0;
+    record.param[1] = param_1;
+    record.param[2] = param_2;
+    record.param[3] = param_3;
+    fwrite(&record, sizeof(record), 1, trace_file);
+    float coordinate[DIM];
+    for (int i = 0; i < point_num; i++)
+    {
+        for (int j = 0; j < DIM; j++)
+            coordinate[j] = Traits::get(points[i], j);
+        fwrite(coordinate, sizeof(coordinate), 1, trace_file);
+    }
+    for (int i = 0; i < box_num; i++)
+    {
+        fwrite(boxes[i].vertex_min, sizeof(float), DIM, trace_file);
+        fwrite(boxes[i].vertex_max, sizeof(float), DIM, trace_file);
+    }
+    if (id_num > 0)
+        fwrite(ids, sizeof(uint32_t), id_num, trace_file);
+    if (time != nullptr)
+        fwrite(time, sizeof(double), time_num, trace_file);
+    if (transform != nullptr)
+    {
+        fwrite(transform->rotation, sizeof(float), 9, trace_file);
+        fwrite(transform->translation, sizeof(float), 3, trace_file);
+    }
+    pthread_mutex_unlock(&trace_mutex_lock);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::start_thread()
+{
+    pthread_mutex_init(&termination_flag_mutex_lock, NULL);
+    pthread_mutex_init(&rebuild_ptr_mutex_lock, NULL);
+    pthread_mutex_init(&rebuild_logger_mutex_lock, NULL);
+    pthread_mutex_init(&points_deleted_rebuild_mutex_lock, NULL);
+    pthread_mutex_init(&working_flag_mutex, NULL);
+    pthread_mutex_init(&search_flag_mutex, NULL);
+    pthread_mutex_init(&trace_mutex_lock, NULL);
+    pthread_mutex_init(&detached_trees_mutex_lock, NULL);
+    pthread_mutex_init(&published_mutex_lock, NULL);
+    pthread_mutexattr_t writer_mutex_attr;
+    pthread_mutexattr_init(&writer_mutex_attr);
+    pthread_mutexattr_settype(&writer_mutex_attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&writer_mutex_lock, &writer_mutex_attr);
+    pthread_mutexattr_destroy(&writer_mutex_attr);
+    pthread_mutex_init(&ingestion_mutex_lock, NULL);
+    pthread_cond_init(&ingestion_queued_cond, NULL);
+    pthread_cond_init(&ingestion_space_cond, NULL);
+    pthread_cond_init(&ingestion_applied_cond, NULL);
+#if METRICS_SWITCH
+    pthread_mutex_init(&metrics_mutex_lock, NULL);
+#endif
+    pthread_create(&rebuild_thread, NULL, multi_thread_ptr, (void *)this);
+    fprintf(stderr, "Multi thread started \n");
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::stop_thread()
+{
+    pthread_mutex_lock(&termination_flag_mutex_lock);
+    termination_flag = true;
+    pthread_mutex_unlock(&termination_flag_mutex_lock);
+    if (rebuild_thread)
+        pthread_join(rebuild_thread, NULL);
+    pthread_mutex_destroy(&termination_flag_mutex_lock);
+    pthread_mutex_destroy(&rebuild_logger_mutex_lock);
+    pthread_mutex_destroy(&rebuild_ptr_mutex_lock);
+    pthread_mutex_destroy(&points_deleted_rebuild_mutex_lock);
+    pthread_mutex_destroy(&working_flag_mutex);
+    pthread_mutex_destroy(&search_flag_mutex);
+    pthread_mutex_destroy(&trace_mutex_lock);
+    pthread_mutex_destroy(&detached_trees_mutex_lock);
+    pthread_mutex_destroy(&published_mutex_lock);
+    pthread_mutex_destroy(&writer_mutex_lock);
+    pthread_mutex_destroy(&ingestion_mutex_lock);
+    pthread_cond_destroy(&ingestion_queued_cond);
+    pthread_cond_destroy(&ingestion_space_cond);
+    pthread_cond_destroy(&ingestion_applied_cond);
+#if METRICS_SWITCH
+    pthread_mutex_destroy(&metrics_mutex_lock);
+#endif
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void *KD_TREE<PointType, DIM, PointStorage>::multi_thread_ptr(void *arg)
+{
+    KD_TREE *handle = (KD_TREE *)arg;
+    handle->multi_thread_rebuild();
+    return nullptr;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::lock_search_shared()
+{
+    pthread_mutex_lock(&search_flag_mutex);
+#if METRICS_SWITCH
+    if (search_mutex_counter == -1)
+    {
+        auto wait_start = chrono::high_resolution_clock::now();
+        while (search_mutex_counter == -1)
+        {
+            pthread_mutex_unlock(&search_flag_mutex);
+            usleep(1);
+            pthread_mutex_lock(&search_flag_mutex);
+        }
+        record_metrics(metrics.search_flag_wait, wait_start);
+    }
+#else
+    while (search_mutex_counter == -1)
+    {
+        pthread_mutex_unlock(&search_flag_mutex);
+        usleep(1);
+        pthread_mutex_lock(&search_flag_mutex);
+    }
+#endif
+    search_mutex_counter += 1;
+    pthread_mutex_unlock(&search_flag_mutex);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::unlock_search_shared()
+{
+    pthread_mutex_lock(&search_flag_mutex);
+    search_mutex_counter -= 1;
+    pthread_mutex_unlock(&search_flag_mutex);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::lock_search_exclusive()
+{
+    pthread_mutex_lock(&search_flag_mutex);
+    while (search_mutex_counter != 0)
+    {
+        pthread_mutex_unlock(&search_flag_mutex);
+        usleep(1);
+        pthread_mutex_lock(&search_flag_mutex);
+    }
+    search_mutex_counter = -1;
+    pthread_mutex_unlock(&search_flag_mutex);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::unlock_search_exclusive()
+{
+    pthread_mutex_lock(&search_flag_mutex);
+    search_mutex_counter = 0;
+    pthread_mutex_unlock(&search_flag_mutex);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::enter_subtree(KD_TREE_NODE **link, int stack_size, int &locked_size)
+{
+    // The subtree on the rebuild thread is read under the shared search lock until the stack is back to stack_size
+    if (locked_size < 0 && Rebuild_Ptr != nullptr && *Rebuild_Ptr == *link)
+    {
+        lock_search_shared();
+        locked_size = stack_size;
+    }
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::leave_subtree(int stack_size, int &locked_size)
+{
+    if (locked_size >= 0 && stack_size <= locked_size)
+    {
+        unlock_search_shared();
+        locked_size = -1;
+    }
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::multi_thread_rebuild()
+{
+    bool terminated = false;
+    KD_TREE_NODE *father_ptr, **new_node_ptr;
+    pthread_mutex_lock(&termination_flag_mutex_lock);
+    terminated = termination_flag;
+    pthread_mutex_unlock(&termination_flag_mutex_lock);
+    while (!terminated)
+    {
+        pthread_mutex_lock(&rebuild_ptr_mutex_lock);
+        pthread_mutex_lock(&working_flag_mutex);
+        // A rebaked tree waits for the writer to swap it in
+        if (Rebuild_Ptr != nullptr && !bake_ready)
+        {
+            /* Traverse and copy */
+            if (!Rebuild_Logger.empty())
+            {
+                fprintf(stderr, "\n\n\n\n\n\n\n\n\n\n\n ERROR!!! \n\n\n\n\n\n\n\n\n");
+            }
+            rebuild_flag = true;
+            if (*Rebuild_Ptr == Root_Node)
+            {
+                Treesize_tmp = Root_Node->TreeSize;
+                Validnum_tmp = Root_Node->TreeSize - Root_Node->invalid_point_num;
+                alpha_bal_tmp = Root_Node->alpha_bal;
+                alpha_del_tmp = Root_Node->alpha_del;
+            }
+#if METRICS_SWITCH
+            auto rebuild_start = chrono::high_resolution_clock::now();
+#endif
+            bool bake = bake_requested && *Rebuild_Ptr == Root_Node;
+            EntryVector().swap(Rebuild_PCL_Storage);
+            // Lock Search
+            lock_search_exclusive();
+            // Lock deleted points cache
+            pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);
+            flatten_storage(*Rebuild_Ptr, Rebuild_PCL_Storage, MULTI_THREAD_REC);
+            // Unlock deleted points cache
+            pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
+            // Unlock Search
+            unlock_search_exclusive();
+            pthread_mutex_unlock(&working_flag_mutex);
+            if (bake)
+                bake_storage(Rebuild_PCL_Storage);
+            /* Rebuild and update missed operations*/
+            Operation_Logger_Type Operation{};
+            KD_TREE_NODE *new_root_node = nullptr;
+            if (int(Rebuild_PCL_Storage.size()) > 0)
+                BuildTree(&new_root_node, 0, Rebuild_PCL_Storage.size() - 1, Rebuild_PCL_Storage);
+            // Rebuild has been done. Updates the blocked operations into the new tree, also when it is empty: the log must
+            // not be left to the next rebuild, and points added meanwhile go into the empty subtree
+            pthread_mutex_lock(&working_flag_mutex);
+            pthread_mutex_lock(&rebuild_logger_mutex_lock);
+            int tmp_counter = 0;
+            while (!Rebuild_Logger.empty())
+            {
+                Operation = Rebuild_Logger.front();
+                max_queue_size = max(max_queue_size, Rebuild_Logger.size());
+#if METRICS_SWITCH
+                pthread_mutex_lock(&metrics_mutex_lock);
+                metrics.rebuild_logger_max_size = max(metrics.rebuild_logger_max_size, Rebuild_Logger.size());
+                pthread_mutex_unlock(&metrics_mutex_lock);
+#endif
+                Rebuild_Logger.pop();
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                pthread_mutex_unlock(&working_flag_mutex);
+                run_operation(&new_root_node, Operation, bake ? &Bake_Transform : nullptr);
+                tmp_counter++;
+                if (tmp_counter % 10 == 0)
+                    usleep(1);
+                pthread_mutex_lock(&working_flag_mutex);
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+            }
+            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            if (bake)
+            {
+                // The tree is in the new frame, so the writer swaps it in together with the map transform
+                Baked_Root = new_root_node;
+                bake_ready = true;
+                pthread_mutex_unlock(&working_flag_mutex);
+                pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+                free_detached_trees();
+                usleep(100);
+                continue;
+            }
+            /* Replace to original tree*/
+            // pthread_mutex_lock(&working_flag_mutex);
+            lock_search_exclusive();
+            // Read at the swap: the writer may have copied the subtree root or its father away from a snapshot meanwhile
+            KD_TREE_NODE *old_root_node = (*Rebuild_Ptr);
+            father_ptr = old_root_node->father_ptr;
+            if (father_ptr->left_son_ptr == *Rebuild_Ptr)
+            {
+                father_ptr->left_son_ptr = new_root_node;
+            }
+            else if (father_ptr->right_son_ptr == *Rebuild_Ptr)
+            {
+                father_ptr->right_son_ptr = new_root_node;
+            }
+            else
+            {
+                throw "Error: Father ptr incompatible with current node\n";
+            }
+            if (new_root_node != nullptr)
+                new_root_node->father_ptr = father_ptr;
+            (*Rebuild_Ptr) = new_root_node;
+            if (father_ptr == STATIC_ROOT_NODE)
+                Root_Node = STATIC_ROOT_NODE->left_son_ptr;
+            KD_TREE_NODE *update_root = *Rebuild_Ptr;
+            while (update_root != nullptr && update_root != Root_Node)
+            {
+                update_root = update_root->father_ptr;
+                if (update_root->working_flag)
+                    break;
+                if (update_root == update_root->father_ptr->left_son_ptr && update_root->father_ptr->need_push_down_to_left)
+                    break;
+                if (update_root == update_root->father_ptr->right_son_ptr && update_root->father_ptr->need_push_down_to_right)
+                    break;
+                Update(update_root);
+            }
+            unlock_search_exclusive();
+            Rebuild_Ptr = nullptr;
+            // Cleared before a writer that saw the old Rebuild_Ptr gets the mutex, so it does not log for a finished rebuild
+            rebuild_flag = false;
+            pthread_mutex_unlock(&working_flag_mutex);
+#if METRICS_SWITCH
+            record_metrics(metrics.multi_thread_rebuild, rebuild_start);
+#endif
+            /* Delete discarded tree nodes */
+            delete_tree_nodes(&old_root_node);
+        }
+        else
+        {
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+        pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+        free_detached_trees();
+        pthread_mutex_lock(&termination_flag_mutex_lock);
+        terminated = termination_flag;
+        pthread_mutex_unlock(&termination_flag_mutex_lock);
+        usleep(100);
+    }
+    free_detached_trees();
+    fprintf(stderr, "Rebuild thread terminated normally\n");
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::run_operation(KD_TREE_NODE **root, Operation_Logger_Type operation, const KD_TREE_Rigid_Transform *bake_transform)
+{
+    // The rebuilt subtree is empty if all its points were deleted, then only added points change it
+    if (*root == nullptr && operation.op != ADD_POINT)
+        return;
+    int father_axis = *root == nullptr ? DIM - 1 : (*root)->division_axis;
+    // Operations logged against the old frame are moved onto a rebaked tree, boxes are checked in the old frame
+    KD_TREE_Rigid_Transform box_frame;
+    if (bake_transform != nullptr)
+    {
+        box_frame = bake_transform->inverse();
+        if ((operation.op == ADD_POINT || operation.op == DELETE_POINT || operation.op == RESTORE_POINT) && !transform_stored(operation.point, *bake_transform))
+        {
+            if (operation.op == ADD_POINT)
+            {
+                pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);
+                Multithread_Points_deleted.push_back(decode_point(operation.point));
+                pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
+            }
+            return;
+        }
+    }
+    const KD_TREE_Rigid_Transform *frame = bake_transform == nullptr ? nullptr : &box_frame;
+    float baked[DIM];
+    switch (operation.op)
+    {
+    case ADD_POINT:
+#if TIMESTAMP_SWITCH
+        Add_by_point(root, operation.point, operation.point_id, operation.point_time, false, father_axis);
+#else
+        Add_by_point(root, operation.point, operation.point_id, INFINITY, false, father_axis);
+#endif
+        break;
+    case ADD_BOX:
+        Add_by_range(root, operation.boxpoint, false, frame);
+        break;
+    case DELETE_POINT:
+        Delete_by_point(root, operation.point, false);
+        break;
+    case RESTORE_POINT:
+        // The box holding exactly the point
+        for (int i = 0; i < DIM; i++)
+        {
+            operation.boxpoint.vertex_min[i] = point_value(operation.point, i);
+            operation.boxpoint.vertex_max[i] = nextafter(operation.boxpoint.vertex_min[i], INFINITY);
+        }
+        Add_by_range(root, operation.boxpoint, false);
+        break;
+    case DELETE_BOX:
+        Delete_by_range(root, operation.boxpoint, false, false, frame);
+        break;
+    case DOWNSAMPLE_DELETE:
+        Delete_by_range(root, operation.boxpoint, false, true, frame);
+        break;
+    case DELETE_POINT_ID:
+        if (bake_transform == nullptr)
+        {
+            Delete_by_id(root, operation.id_coordinate, operation.point_id, false);
+        }
+        else
+        {
+            bake_coordinate(operation.id_coordinate, baked);
+            Delete_by_id(root, baked, operation.point_id, false);
+        }
+        break;
+#if TIMESTAMP_SWITCH
+    case DELETE_OLDER:
+        Delete_by_time(root, operation.point_time, false);
+        break;
+#endif
+    case PUSH_DOWN:
+        own_node(root);
+        (*root)->tree_downsample_deleted |= operation.tree_downsample_deleted;
+        (*root)->point_downsample_deleted |= operation.tree_downsample_deleted;
+        (*root)->tree_deleted = operation.tree_deleted || (*root)->tree_downsample_deleted;
+        (*root)->point_deleted = (*root)->tree_deleted || (*root)->point_downsample_deleted;
+        if (operation.tree_downsample_deleted)
+            (*root)->down_del_num = (*root)->TreeSize;
+        if (operation.tree_deleted)
+            (*root)->invalid_point_num = (*root)->TreeSize;
+        else
+            (*root)->invalid_point_num = (*root)->down_del_num;
+        (*root)->need_push_down_to_left = true;
+        (*root)->need_push_down_to_right = true;
+        break;
+    default:
+        break;
+    }
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Build(PointVector point_cloud)
+{
+    build_points(point_cloud, INFINITY);
+}
+
+#if TIMESTAMP_SWITCH
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Build(PointVector point_cloud, double timestamp)
+{
+    build_points(point_cloud, timestamp);
+}
+#endif
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::build_points(PointVector &point_cloud, double timestamp)
+{
+    Publish_Guard publish_guard(this);
+    if (trace_file != nullptr)
+    {
+        bool timed = timestamp != INFINITY;
+        record_trace(TRACE_BUILD, timed ? TRACE_FLAG_TIMED : 0, 0, 0, 0, 0, point_cloud.data(), point_cloud.size(), nullptr, 0, timed ? &timestamp : nullptr);
+    }
+    if (Root_Node != nullptr)
+    {
+        delete_tree_nodes(&Root_Node);
+    }
+    clear_point_ids();
+    if (point_cloud.size() == 0)
+        return;
+    EntryVector entries;
+    entries.reserve(point_cloud.size());
+    Point_Entry_Type entry;
+    for (size_t i = 0; i < point_cloud.size(); i++)
+    {
+        if (!point_storage->encode(to_stored(point_cloud[i]), entry.point))
+            continue;
+        entry.point_id = assign_point_id(entry.point);
+#if TIMESTAMP_SWITCH
+        entry.point_time = timestamp;
+#endif
+        entries.push_back(entry);
+    }
+    if (entries.size() == 0)
+        return;
+    STATIC_ROOT_NODE = new KD_TREE_NODE;
+    InitTreeNode(STATIC_ROOT_NODE);
+    BuildTree(&STATIC_ROOT_NODE->left_son_ptr, 0, entries.size() - 1, entries);
+    Update(STATIC_ROOT_NODE);
+    STATIC_ROOT_NODE->TreeSize = 0;
+    Root_Node = STATIC_ROOT_NODE->left_son_ptr;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist, float epsilon, int max_visit)
+{
+    if (k_nearest <= 0)
+    {
+        Nearest_Points.clear();
+        Point_Distance.clear();
+        return;
+    }
+    Snapshot_Ptr published;
+    if (KD_TREE *view = published_view(published))
+    {
+        view->Nearest_Search(point, k_nearest, Nearest_Points, Point_Distance, max_dist, epsilon, max_visit);
+        return;
+    }
+    if (trace_file != nullptr)
+        record_trace(TRACE_NEAREST_SEARCH, false, k_nearest, max_dist, epsilon, max_visit, &point, 1, nullptr, 0);
+#if METRICS_SWITCH
+    auto search_start = chrono::high_resolution_clock::now();
+#endif
+    MANUAL_HEAP q(2 * k_nearest);
+    Search_Root(to_stored(point), k_nearest, q, max_dist, epsilon, max_visit);
+    int k_found = min(k_nearest, int(q.size()));
+    PointVector().swap(Nearest_Points);
+    vector<float>().swap(Point_Distance);
+    for (int i = 0; i < k_found; i++)
+    {
+        Nearest_Points.insert(Nearest_Points.begin(), q.top().point);
+        Point_Distance.insert(Point_Distance.begin(), q.top().dist);
+        q.pop();
+    }
+    to_map(Nearest_Points);
+#if METRICS_SWITCH
+    record_metrics(metrics.nearest_search, search_start);
+#endif
+    return;
+}
+
+#if TIMESTAMP_SWITCH
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Nearest_Search_Recent(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, double min_time, float max_dist)
+{
+    if (k_nearest <= 0)
+    {
+        Nearest_Points.clear();
+        Point_Distance.clear();
+        return;
+    }
+    Snapshot_Ptr published;
+    if (KD_TREE *view = published_view(published))
+    {
+        view->Nearest_Search_Recent(point, k_nearest, Nearest_Points, Point_Distance, min_time, max_dist);
+        return;
+    }
+    if (trace_file != nullptr)
+        record_trace(TRACE_NEAREST_SEARCH_RECENT, 0, k_nearest, max_dist, 0, 0, &point, 1, nullptr, 0, &min_time);
+#if METRICS_SWITCH
+    auto search_start = chrono::high_resolution_clock::now();
+#endif
+    MANUAL_HEAP q(2 * k_nearest);
+    Search_Root(to_stored(point), k_nearest, q, max_dist, 0.0f, 0, nullptr, min_time);
+    int k_found = min(k_nearest, int(q.size()));
+    Nearest_Points.resize(k_found);
+    Point_Distance.resize(k_found);
+    for (int i = k_found - 1; i >= 0; i--)
+    {
+        Nearest_Points[i] = q.top().point;
+        Point_Distance[i] = q.top().dist;
+        q.pop();
+    }
+    to_map(Nearest_Points);
+#if METRICS_SWITCH
+    record_metrics(metrics.nearest_search_recent, search_start);
+#endif
+}
+#endif
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage)
+{
+    Snapshot_Ptr published;
+    if (KD_TREE *view = published_view(published))
+    {
+        view->Box_Search(Box_of_Point, Storage);
+        return;
+    }
+    if (trace_file != nullptr)
+        record_trace(TRACE_BOX_SEARCH, false, 0, 0, 0, 0, nullptr, 0, &Box_of_Point, 1);
+#if METRICS_SWITCH
+    auto search_start = chrono::high_resolution_clock::now();
+#endif
+    Storage.clear();
+    BoxPointType box = Box_of_Point;
+    const KD_TREE_Rigid_Transform *box_frame = map_box_frame(box);
+    Search_by_range(&Root_Node, box, Storage, box_frame);
+    to_map(Storage);
+#if METRICS_SWITCH
+    record_metrics(metrics.box_search, search_start);
+#endif
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Radius_Search(PointType point, const float radius, PointVector &Storage)
+{
+    Snapshot_Ptr published;
+    if (KD_TREE *view = published_view(published))
+    {
+        view->Radius_Search(point, radius, Storage);
+        return;
+    }
+    if (trace_file != nullptr)
+        record_trace(TRACE_RADIUS_SEARCH, false, radius, 0, 0, 0, &point, 1, nullptr, 0);
+    Storage.clear();
+    Search_by_radius(&Root_Node, to_stored(point), radius, Storage);
+    to_map(Storage);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Radius_Search(PointType point, const float radius, int max_num, PointVector &Storage, vector<float> &Point_Distance)
+{
+    if (max_num <= 0)
+    {
+        Storage.clear();
+        Point_Distance.clear();
+        return;
+    }
+    Snapshot_Ptr published;
+    if (KD_TREE *view = published_view(published))
+    {
+        view->Radius_Search(point, radius, max_num, Storage, Point_Distance);
+        return;
+    }
+    // A k-nearest search bounded by the radius: nothing outside the ball is visited, and once max_num points are found
+    // the bound shrinks to the current max_num-th distance
+    if (trace_file != nullptr)
+        record_trace(TRACE_RADIUS_SEARCH_CAPPED, false, radius, max_num, 0, 0, &point, 1, nullptr, 0);
+#if METRICS_SWITCH
+    auto search_start = chrono::high_resolution_clock::now();
+#endif
+    MANUAL_HEAP q(2 * max_num);
+    Search_Root(to_stored(point), max_num, q, radius, 0.0f, 0);
+    int num_found = min(max_num, int(q.size()));
+    Storage.resize(num_found);
+    Point_Distance.resize(num_found);
+    for (int i = num_found - 1; i >= 0; i--)
+    {
+        Storage[i] = q.top().point;
+        Point_Distance[i] = q.top().dist;
+        q.pop();
+    }
+    to_map(Storage);
+#if METRICS_SWITCH
+    record_metrics(metrics.radius_search_capped, search_start);
+#endif
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Search_Root(PointType point, int k_nearest, MANUAL_HEAP &q, float max_dist, float epsilon, int max_visit, Search_Hint *hint, double min_time)
+{
+#if METRICS_SWITCH
+    search_visited_counter = 0;
+#endif
+    q.clear();
+    // Box distances are squared, so is the approximation factor
+    float prune_scale = (1.0f + epsilon) * (1.0f + epsilon);
+    int visit_budget = max_visit > 0 ? max_visit : INT_MAX;
+    if (hint == nullptr)
+    {
+        Search(&Root_Node, k_nearest, point, q, max_dist, prune_scale, visit_budget, nullptr, min_time);
+    }
+    else
+    {
+        // Follow the hinted path as far as it still exists. Passing the subtree on the rebuild thread takes the shared search lock.
+        int locked_size = -1;
+        KD_TREE_NODE **hint_link = &Root_Node;
+        int hint_depth = 0;
+        Pending_Labels hint_labels;
+        Node_Labels labels;
+        // Cell of the subtree: the points below a node are on its side of the division planes of all its fathers
+        float cell[DIM][2];
+        for (int i = 0; i < DIM; i++)
+        {
+            cell[i][0] = -INFINITY;
+            cell[i][1] = INFINITY;
+        }
+        while (hint_depth < hint->depth)
+        {
+            enter_subtree(hint_link, 0, locked_size);
+            KD_TREE_NODE *node = *hint_link;
+            if (node == nullptr)
+                break;
+            bool go_right = hint->path >> hint_depth & 1;
+            KD_TREE_NODE **son_link = go_right ? &node->right_son_ptr : &node->left_son_ptr;
+            if (*son_link == nullptr)
+                break;
+            read_labels(node, hint_labels, labels);
+            hint_labels = go_right ? labels.right : labels.left;
+            float division = point_value(node->point, node->division_axis);
+            if (go_right)
+                cell[node->division_axis][0] = max(cell[node->division_axis][0], division);
+            else
+                cell[node->division_axis][1] = min(cell[node->division_axis][1], division);
+            hint_link = son_link;
+            hint_depth++;
+        }
+        // The hinted subtree is searched first to seed the heap. Its answer is already exact if the ball around the query
+        // through the k-th point (or max_dist) is strictly inside the cell, as no point outside the subtree can be in it.
+        // Otherwise the rest of the tree is searched with the tight bound.
+        KD_TREE_NODE *hint_node = nullptr;
+        if (hint_depth > 0)
+        {
+            Search(hint_link, k_nearest, point, q, max_dist, prune_scale, visit_budget, nullptr, min_time, hint_labels);
+            hint_node = *hint_link;
+            float radius = q.size() >= k_nearest ? sqrt(q.top().dist) : max_dist;
+            if (hint_node == nullptr || !ball_inside(cell, point, radius))
+                Search(&Root_Node, k_nearest, point, q, max_dist, prune_scale, visit_budget, hint_node, min_time);
+        }
+        else
+        {
+            Search(&Root_Node, k_nearest, point, q, max_dist, prune_scale, visit_budget, nullptr, min_time);
+        }
+        // Move the hint down to the smallest subtree of at least Search_Hint_Min_Size points whose range holds the query,
+        // starting over from the root once the query has left the hinted subtree
+        if (hint_node == nullptr || calc_box_dist(hint_node, point) > 0.0f)
+        {
+            hint_link = &Root_Node;
+            hint_depth = 0;
+        }
+        while (hint_depth < 64 && *hint_link != nullptr)
+        {
+            enter_subtree(hint_link, 0, locked_size);
+            KD_TREE_NODE *node = *hint_link;
+            bool go_right = calc_box_dist(node->right_son_ptr, point) < calc_box_dist(node->left_son_ptr, point);
+            KD_TREE_NODE **son_link = go_right ? &node->right_son_ptr : &node->left_son_ptr;
+            if (*son_link == nullptr || (*son_link)->TreeSize < Search_Hint_Min_Size)
+                break;
+            if (go_right)
+                hint->path |= uint64_t(1) << hint_depth;
+            else
+                hint->path &= ~(uint64_t(1) << hint_depth);
+            hint_link = son_link;
+            hint_depth++;
+        }
+        hint->depth = hint_depth;
+        leave_subtree(0, locked_size);
+    }
+#if METRICS_SWITCH
+    if (snapshot_generation == 0)
+    {
+        pthread_mutex_lock(&metrics_mutex_lock);
+        metrics.search_visited_nodes.record(search_visited_counter);
+        pthread_mutex_unlock(&metrics_mutex_lock);
+    }
+#endif
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+bool KD_TREE<PointType, DIM, PointStorage>::ball_inside(const float cell[][2], const PointType &point, float radius)
+{
+    for (int i = 0; i < DIM; i++)
+    {
+        float value = Traits::get(point, i);
+        if (!(cell[i][0] < value - radius && value + radius < cell[i][1]))
+            return false;
+    }
+    return true;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::fit_plane(MANUAL_HEAP &q, int k_nearest, const PointType &point, float max_residual, Plane_Fit &plane)
+{
+    static_assert(DIM >= 3, "Plane fitting needs a 3D tree");
+    plane.num = q.size();
+    plane.valid = false;
+    plane.residual = INFINITY;
+    if (plane.num < 3)
+        return;
+    // Centroid and covariance relative to the query, which keeps the sums small for points far from the origin
+    Eigen::Vector3f center = Eigen::Vector3f::Zero();
+    Eigen::Matrix3f covariance = Eigen::Matrix3f::Zero();
+    Eigen::Vector3f origin(Traits::get(point, 0), Traits::get(point, 1), Traits::get(point, 2));
+    for (int i = 0; i < plane.num; i++)
+    {
+        const PointType &neighbor = q.at(i).point;
+        Eigen::Vector3f p = Eigen::Vector3f(Traits::get(neighbor, 0), Traits::get(neighbor, 1), Traits::get(neighbor, 2)) - origin;
+        center += p;
+        covariance += p * p.transpose();
+    }
+    center /= plane.num;
+    covariance = covariance / plane.num - center * center.transpose();
+    // The normal is the direction of least variance
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> solver;
+    solver.computeDirect(covariance);
+    Eigen::Vector3f normal = solver.eigenvectors().col(0).normalized();
+    float residual = 0.0f;
+    for (int i = 0; i < plane.num; i++)
+    {
+        const PointType &neighbor = q.at(i).point;
+        Eigen::Vector3f p = Eigen::Vector3f(Traits::get(neighbor, 0), Traits::get(neighbor, 1), Traits::get(neighbor, 2)) - origin;
+        residual = max(residual, fabsf(normal.dot(p - center)));
+    }
+    for (int i = 0; i < 3; i++)
+        plane.normal[i] = normal[i];
+    plane.d = -normal.dot(center + origin);
+    plane.residual = residual;
+    plane.valid = plane.num >= k_nearest && residual <= max_residual;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+bool KD_TREE<PointType, DIM, PointStorage>::Nearest_Plane(PointType point, int k_nearest, Plane_Fit &plane, float max_residual, float max_dist)
+{
+    if (k_nearest <= 0)
+    {
+        plane = Plane_Fit();
+        return false;
+    }
+    Snapshot_Ptr published;
+    if (KD_TREE *view = published_view(published))
+        return view->Nearest_Plane(point, k_nearest, plane, max_residual, max_dist);
+    if (trace_file != nullptr)
+        record_trace(TRACE_NEAREST_PLANE, false, k_nearest, max_dist, max_residual, 0, &point, 1, nullptr, 0);
+#if METRICS_SWITCH
+    auto search_start = chrono::high_resolution_clock::now();
+#endif
+    MANUAL_HEAP q(2 * k_nearest);
+    point = to_stored(point);
+    Search_Root(point, k_nearest, q, max_dist, 0.0f, 0);
+    fit_plane(q, k_nearest, point, max_residual, plane);
+    to_map(plane);
+#if METRICS_SWITCH
+    record_metrics(metrics.nearest_plane, search_start);
+#endif
+    return plane.valid;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::Nearest_Plane_Batch(const PointVector &points, int k_nearest, vector<Plane_Fit> &planes, float max_residual, float max_dist)
+{
+    if (k_nearest <= 0)
+    {
+        planes.assign(points.size(), Plane_Fit());
+        return 0;
+    }
+    Snapshot_Ptr published;
+    if (KD_TREE *view = published_view(published))
+        return view->Nearest_Plane_Batch(points, k_nearest, planes, max_residual, max_dist);
+    if (trace_file != nullptr)
+        record_trace(TRACE_NEAREST_PLANE_BATCH, false, k_nearest, max_dist, max_residual, 0, points.data(), points.size(), nullptr, 0);
+    // One heap and one output vector for the whole scan
+    MANUAL_HEAP q(2 * k_nearest);
+    int valid_num = 0;
+    planes.resize(points.size());
+    for (size_t i = 0; i < points.size(); i++)
+    {
+#if METRICS_SWITCH
+        auto search_start = chrono::high_resolution_clock::now();
+#endif
+        PointType query = to_stored(points[i]);
+        Search_Root(query, k_nearest, q, max_dist, 0.0f, 0);
+        fit_plane(q, k_nearest, query, max_residual, planes[i]);
+        to_map(planes[i]);
+        valid_num += planes[i].valid;
+#if METRICS_SWITCH
+        record_metrics(metrics.nearest_plane, search_start);
+#endif
+    }
+    return valid_num;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, Search_Hint &hint, float max_dist)
+{
+    if (k_nearest <= 0)
+    {
+        Nearest_Points.clear();
+        Point_Distance.clear();
+        return;
+    }
+    Snapshot_Ptr published;
+    if (KD_TREE *view = published_view(published))
+    {
+        view->Nearest_Search(point, k_nearest, Nearest_Points, Point_Distance, hint, max_dist);
+        return;
+    }
+    if (trace_file != nullptr)
+        record_trace(TRACE_NEAREST_SEARCH, false, k_nearest, max_dist, 0, 0, &point, 1, nullptr, 0);
+#if METRICS_SWITCH
+    auto search_start = chrono::high_resolution_clock::now();
+#endif
+    MANUAL_HEAP q(2 * k_nearest);
+    Search_Root(to_stored(point), k_nearest, q, max_dist, 0.0f, 0, &hint);
+    int k_found = min(k_nearest, int(q.size()));
+    Nearest_Points.resize(k_found);
+    Point_Distance.resize(k_found);
+    for (int i = k_found - 1; i >= 0; i--)
+    {
+        Nearest_Points[i] = q.top().point;
+        Point_Distance[i] = q.top().dist;
+        q.pop();
+    }
+    to_map(Nearest_Points);
+#if METRICS_SWITCH
+    record_metrics(metrics.nearest_search, search_start);
+#endif
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Nearest_Search_ID(PointType point, int k_nearest, vector<uint32_t> &Nearest_IDs, vector<float> &Point_Distance, Search_Hint &hint, float max_dist)
+{
+    if (k_nearest <= 0)
+    {
+        Nearest_IDs.clear();
+        Point_Distance.clear();
+        return;
+    }
+    Snapshot_Ptr published;
+    if (KD_TREE *view = published_view(published))
+    {
+        view->Nearest_Search_ID(point, k_nearest, Nearest_IDs, Point_Distance, hint, max_dist);
+        return;
+    }
+    if (trace_file != nullptr)
+        record_trace(TRACE_NEAREST_SEARCH, false, k_nearest, max_dist, 0, 0, &point, 1, nullptr, 0);
+#if METRICS_SWITCH
+    auto search_start = chrono::high_resolution_clock::now();
+#endif
+    MANUAL_HEAP q(2 * k_nearest);
+    Search_Root(to_stored(point), k_nearest, q, max_dist, 0.0f, 0, &hint);
+    int k_found = min(k_nearest, int(q.size()));
+    Nearest_IDs.resize(k_found);
+    Point_Distance.resize(k_found);
+    for (int i = k_found - 1; i >= 0; i--)
+    {
+        Nearest_IDs[i] = q.top().point_id;
+        Point_Distance[i] = q.top().dist;
+        q.pop();
+    }
+#if METRICS_SWITCH
+    record_metrics(metrics.nearest_search, search_start);
+#endif
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Nearest_Search_ID(PointType point, int k_nearest, vector<uint32_t> &Nearest_IDs, vector<float> &Point_Distance, float max_dist, float epsilon, int max_visit)
+{
+    if (k_nearest <= 0)
+    {
+        Nearest_IDs.clear();
+        Point_Distance.clear();
+        return;
+    }
+    Snapshot_Ptr published;
+    if (KD_TREE *view = published_view(published))
+    {
+        view->Nearest_Search_ID(point, k_nearest, Nearest_IDs, Point_Distance, max_dist, epsilon, max_visit);
+        return;
+    }
+    if (trace_file != nullptr)
+        record_trace(TRACE_NEAREST_SEARCH, false, k_nearest, max_dist, epsilon, max_visit, &point, 1, nullptr, 0);
+#if METRICS_SWITCH
+    auto search_start = chrono::high_resolution_clock::now();
+#endif
+    MANUAL_HEAP q(2 * k_nearest);
+    Search_Root(to_stored(point), k_nearest, q, max_dist, epsilon, max_visit);
+    int k_found = min(k_nearest, int(q.size()));
+    Nearest_IDs.resize(k_found);
+    Point_Distance.resize(k_found);
+    for (int i = k_found - 1; i >= 0; i--)
+    {
+        Nearest_IDs[i] = q.top().point_id;
+        Point_Distance[i] = q.top().dist;
+        q.pop();
+    }
+#if METRICS_SWITCH
+    record_metrics(metrics.nearest_search, search_start);
+#endif
+    return;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Box_Search_ID(const BoxPointType &Box_of_Point, vector<uint32_t> &Storage)
+{
+    Snapshot_Ptr published;
+    if (KD_TREE *view = published_view(published))
+    {
+        view->Box_Search_ID(Box_of_Point, Storage);
+        return;
+    }
+    if (trace_file != nullptr)
+        record_trace(TRACE_BOX_SEARCH, false, 0, 0, 0, 0, nullptr, 0, &Box_of_Point, 1);
+#if METRICS_SWITCH
+    auto search_start = chrono::high_resolution_clock::now();
+#endif
+    Storage.clear();
+    BoxPointType box = Box_of_Point;
+    const KD_TREE_Rigid_Transform *box_frame = map_box_frame(box);
+    Search_by_range(&Root_Node, box, Storage, box_frame);
+#if METRICS_SWITCH
+    record_metrics(metrics.box_search, search_start);
+#endif
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Radius_Search_ID(PointType point, const float radius, vector<uint32_t> &Storage)
+{
+    Snapshot_Ptr published;
+    if (KD_TREE *view = published_view(published))
+    {
+        view->Radius_Search_ID(point, radius, Storage);
+        return;
+    }
+    if (trace_file != nullptr)
+        record_trace(TRACE_RADIUS_SEARCH, false, radius, 0, 0, 0, &point, 1, nullptr, 0);
+    Storage.clear();
+    Search_by_radius(&Root_Node, to_stored(point), radius, Storage);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Radius_Search_ID(PointType point, const float radius, int max_num, vector<uint32_t> &Storage, vector<float> &Point_Distance)
+{
+    if (max_num <= 0)
+    {
+        Storage.clear();
+        Point_Distance.clear();
+        return;
+    }
+    Snapshot_Ptr published;
+    if (KD_TREE *view = published_view(published))
+    {
+        view->Radius_Search_ID(point, radius, max_num, Storage, Point_Distance);
+        return;
+    }
+    if (trace_file != nullptr)
+        record_trace(TRACE_RADIUS_SEARCH_CAPPED, false, radius, max_num, 0, 0, &point, 1, nullptr, 0);
+#if METRICS_SWITCH
+    auto search_start = chrono::high_resolution_clock::now();
+#endif
+    MANUAL_HEAP q(2 * max_num);
+    Search_Root(to_stored(point), max_num, q, radius, 0.0f, 0);
+    int num_found = min(max_num, int(q.size()));
+    Storage.resize(num_found);
+    Point_Distance.resize(num_found);
+    for (int i = num_found - 1; i >= 0; i--)
+    {
+        Storage[i] = q.top().point_id;
+        Point_Distance[i] = q.top().dist;
+        q.pop();
+    }
+#if METRICS_SWITCH
+    record_metrics(metrics.radius_search_capped, search_start);
+#endif
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+uint32_t KD_TREE<PointType, DIM, PointStorage>::assign_point_id(const StoredPoint &point)
+{
+    if (next_point_id == INVALID_POINT_ID)
+    {
+        if (!point_ids_exhausted)
+            fprintf(stderr, "Point ids exhausted, new points get INVALID_POINT_ID until the next Build\n");
+        point_ids_exhausted = true;
+        return INVALID_POINT_ID;
+    }
+    size_t page = next_point_id / ID_Page_Size;
+    if (page == ID_Pages.size())
+        ID_Pages.emplace_back(ID_Page_Size * DIM);
+    float *coordinate = &ID_Pages[page][DIM * (next_point_id % ID_Page_Size)];
+    for (int i = 0; i < DIM; i++)
+        coordinate[i] = point_value(point, i);
+    return next_point_id++;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+const float *KD_TREE<PointType, DIM, PointStorage>::id_coordinate(uint32_t point_id) const
+{
+    if (point_id >= next_point_id || ID_Pages[point_id / ID_Page_Size].empty())
+        return nullptr;
+    return &ID_Pages[point_id / ID_Page_Size][DIM * (point_id % ID_Page_Size)];
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::clear_point_ids()
+{
+    next_point_id = 0;
+    point_ids_exhausted = false;
+    vector<vector<float>>().swap(ID_Pages);
+    id_sweep_mark = 0;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::sweep_point_ids()
+{
+    // Every node counts, deleted ones included, as Add_Point_Boxes may restore them. The subtree on the rebuild thread is
+    // read under the shared search lock.
+    vector<bool> page_used(ID_Pages.size(), false);
+    MANUAL_STACK<KD_TREE_NODE **> stack;
+    int locked_size = -1;
+    stack.push(&Root_Node);
+    while (!stack.empty())
+    {
+        leave_subtree(stack.size(), locked_size);
+        KD_TREE_NODE **link = stack.pop();
+        enter_subtree(link, stack.size(), locked_size);
+        KD_TREE_NODE *node = *link;
+        if (node == nullptr)
+            continue;
+        if (node->point_id != INVALID_POINT_ID)
+            page_used[node->point_id / ID_Page_Size] = true;
+        if (node->left_son_ptr != nullptr)
+            stack.push(&node->left_son_ptr);
+        if (node->right_son_ptr != nullptr)
+            stack.push(&node->right_son_ptr);
+    }
+    leave_subtree(0, locked_size);
+    // The page being filled stays
+    for (size_t page = 0; page + 1 < ID_Pages.size(); page++)
+    {
+        if (!page_used[page])
+            vector<float>().swap(ID_Pages[page]);
+    }
+    id_sweep_mark = next_point_id;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::Add_Points(PointVector &PointToAdd, bool downsample_on)
+{
+    vector<uint32_t> Point_IDs;
+    return add_points(PointToAdd, downsample_on, Point_IDs, INFINITY);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::Add_Points(PointVector &PointToAdd, bool downsample_on, vector<uint32_t> &Point_IDs)
+{
+    return add_points(PointToAdd, downsample_on, Point_IDs, INFINITY);
+}
+
+#if TIMESTAMP_SWITCH
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::Add_Points(PointVector &PointToAdd, bool downsample_on, double timestamp)
+{
+    vector<uint32_t> Point_IDs;
+    return add_points(PointToAdd, downsample_on, Point_IDs, timestamp);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::Add_Points(PointVector &PointToAdd, bool downsample_on, vector<uint32_t> &Point_IDs, double timestamp)
+{
+    return add_points(PointToAdd, downsample_on, Point_IDs, timestamp);
+}
+#endif
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::add_points(PointVector &PointToAdd, bool downsample_on, vector<uint32_t> &Point_IDs, double timestamp)
+{
+    Publish_Guard publish_guard(this);
+    if (trace_file != nullptr)
+    {
+        bool timed = timestamp != INFINITY;
+        int flag = (downsample_on ? TRACE_FLAG_DOWNSAMPLE : 0) | (timed ? TRACE_FLAG_TIMED : 0);
+        record_trace(TRACE_ADD_POINTS, flag, 0, 0, 0, 0, PointToAdd.data(), PointToAdd.size(), nullptr, 0, timed ? &timestamp : nullptr);
+    }
+#if METRICS_SWITCH
+    auto add_start = chrono::high_resolution_clock::now();
+#endif
+    finish_rebake();
+    if (next_point_id - id_sweep_mark >= uint32_t(max(size(), ID_Page_Size)))
+        sweep_point_ids();
+    int NewPointSize = PointToAdd.size();
+    int tree_size = size();
+    BoxPointType Box_of_Point;
+    StoredPoint new_point, downsample_result;
+    PointType mid_point;
+    uint32_t downsample_id;
+    bool downsample_switch = downsample_on && DOWNSAMPLE_SWITCH;
+    float min_dist, tmp_dist;
+    int tmp_counter = 0;
+    Point_IDs.resize(PointToAdd.size());
+    for (int i = 0; i < PointToAdd.size(); i++)
+    {
+        // Points the storage can't encode (out of quantization tiles) are skipped
+        if (!point_storage->encode(to_stored(PointToAdd[i]), new_point))
+        {
+            Point_IDs[i] = INVALID_POINT_ID;
+            continue;
+        }
+        if (downsample_switch)
+        {
+            mid_point = PointToAdd[i];
+            for (int axis = 0; axis < DIM; axis++)
+            {
+                Box_of_Point.vertex_min[axis] = floor(point_value(new_point, axis) / downsample_size) * downsample_size;
+                Box_of_Point.vertex_max[axis] = Box_of_Point.vertex_min[axis] + downsample_size;
+                Traits::set(mid_point, axis, Box_of_Point.vertex_min[axis] + (Box_of_Point.vertex_max[axis] - Box_of_Point.vertex_min[axis]) / 2.0);
+            }
+            EntryVector().swap(Downsample_Storage);
+            Search_by_range(&Root_Node, Box_of_Point, Downsample_Storage);
+            min_dist = calc_dist(new_point, mid_point);
+            downsample_result = new_point;
+            downsample_id = INVALID_POINT_ID;
+            for (size_t index = 0; index < Downsample_Storage.size(); index++)
+            {
+                tmp_dist = calc_dist(Downsample_Storage[index].point, mid_point);
+                if (tmp_dist < min_dist)
+                {
+                    min_dist = tmp_dist;
+                    downsample_result = Downsample_Storage[index].point;
+                    downsample_id = Downsample_Storage[index].point_id;
+                }
+            }
+            // A kept map point is re-inserted with its own id, a new point receives a new one
+            bool need_add = Downsample_Storage.size() > 1 || same_point(new_point, downsample_result);
+            if (need_add && downsample_id == INVALID_POINT_ID)
+                downsample_id = assign_point_id(downsample_result);
+            Point_IDs[i] = downsample_id;
+            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+            {
+                if (need_add)
+                {
+                    if (Downsample_Storage.size() > 0)
+                        Delete_by_range(&Root_Node, Box_of_Point, true, true);
+                    Add_by_point(&Root_Node, downsample_result, downsample_id, timestamp, true, Root_Node->division_axis);
+                    tmp_counter++;
+                }
+            }
+            else
+            {
+                if (need_add)
+                {
+                    Operation_Logger_Type operation_delete{}, operation{};
+                    operation_delete.boxpoint = Box_of_Point;
+                    operation_delete.op = DOWNSAMPLE_DELETE;
+                    operation.point = downsample_result;
+                    operation.point_id = downsample_id;
+#if TIMESTAMP_SWITCH
+                    operation.point_time = timestamp;
+#endif
+                    operation.op = ADD_POINT;
+                    pthread_mutex_lock(&working_flag_mutex);
+                    if (Downsample_Storage.size() > 0)
+                        Delete_by_range(&Root_Node, Box_of_Point, false, true);
+                    Add_by_point(&Root_Node, downsample_result, downsample_id, timestamp, false, Root_Node->division_axis);
+                    tmp_counter++;
+                    if (rebuild_flag)
+                    {
+                        pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                        if (Downsample_Storage.size() > 0)
+                            Rebuild_Logger.push(operation_delete);
+                        Rebuild_Logger.push(operation);
+                        pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                    }
+                    pthread_mutex_unlock(&working_flag_mutex);
+                };
+            }
+        }
+        else
+        {
+            Point_IDs[i] = assign_point_id(new_point);
+            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+            {
+                Add_by_point(&Root_Node, new_point, Point_IDs[i], timestamp, true, Root_Node->division_axis);
+            }
+            else
+            {
+                Operation_Logger_Type operation{};
+                operation.point = new_point;
+                operation.point_id = Point_IDs[i];
+#if TIMESTAMP_SWITCH
+                operation.point_time = timestamp;
+#endif
+                operation.op = ADD_POINT;
+                pthread_mutex_lock(&working_flag_mutex);
+                Add_by_point(&Root_Node, new_point, Point_IDs[i], timestamp, false, Root_Node->division_axis);
+                if (rebuild_flag)
+                {
+                    pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                    Rebuild_Logger.push(operation);
+                    pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                }
+                pthread_mutex_unlock(&working_flag_mutex);
+            }
+        }
+    }
+#if METRICS_SWITCH
+    record_metrics(metrics.add_points, add_start);
+#endif
+    return tmp_counter;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Add_Point_Boxes(vector<BoxPointType> &BoxPoints)
+{
+    Publish_Guard publish_guard(this);
+    if (trace_file != nullptr)
+        record_trace(TRACE_ADD_BOXES, false, 0, 0, 0, 0, nullptr, 0, BoxPoints.data(), BoxPoints.size());
+    for (int i = 0; i < BoxPoints.size(); i++)
+    {
+        BoxPointType box = BoxPoints[i];
+        const KD_TREE_Rigid_Transform *box_frame = map_box_frame(box);
+        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+        {
+            Add_by_range(&Root_Node, box, true, box_frame);
+        }
+        else if (box_frame != nullptr)
+        {
+            // The rebuild thread only replays boxes of the stored frame
+            pthread_mutex_lock(&working_flag_mutex);
+            restore_points_logged(&Root_Node, box, box_frame);
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+        else
+        {
+            Operation_Logger_Type operation{};
+            operation.boxpoint = box;
+            operation.op = ADD_BOX;
+            pthread_mutex_lock(&working_flag_mutex);
+            Add_by_range(&Root_Node, box, false);
+            if (rebuild_flag)
+            {
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(operation);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            }
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+    }
+    return;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Delete_Points(PointVector &PointToDel)
+{
+    Publish_Guard publish_guard(this);
+    if (trace_file != nullptr)
+        record_trace(TRACE_DELETE_POINTS, false, 0, 0, 0, 0, PointToDel.data(), PointToDel.size(), nullptr, 0);
+    StoredPoint del_point;
+    for (int i = 0; i < PointToDel.size(); i++)
+    {
+        // A point the storage has no encoding for can't be in the tree
+        if (!point_storage->find(to_stored(PointToDel[i]), del_point))
+            continue;
+        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+        {
+            Delete_by_point(&Root_Node, del_point, true);
+        }
+        else
+        {
+            Operation_Logger_Type operation{};
+            operation.point = del_point;
+            operation.op = DELETE_POINT;
+            pthread_mutex_lock(&working_flag_mutex);
+            Delete_by_point(&Root_Node, del_point, false);
+            if (rebuild_flag)
+            {
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(operation);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            }
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+    }
+    return;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::Delete_By_Id(vector<uint32_t> &PointIDs)
+{
+    Publish_Guard publish_guard(this);
+    if (trace_file != nullptr)
+        record_trace(TRACE_DELETE_BY_ID, 0, 0, 0, 0, 0, nullptr, 0, nullptr, 0, nullptr, PointIDs.data(), PointIDs.size());
+    int tmp_counter = 0;
+    for (size_t i = 0; i < PointIDs.size(); i++)
+    {
+        const float *coordinate = id_coordinate(PointIDs[i]);
+        if (coordinate == nullptr)
+            continue;
+        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+        {
+            tmp_counter += Delete_by_id(&Root_Node, coordinate, PointIDs[i], true);
+        }
+        else
+        {
+            Operation_Logger_Type operation{};
+            operation.point_id = PointIDs[i];
+            memcpy(operation.id_coordinate, coordinate, sizeof(operation.id_coordinate));
+            operation.op = DELETE_POINT_ID;
+            pthread_mutex_lock(&working_flag_mutex);
+            tmp_counter += Delete_by_id(&Root_Node, coordinate, PointIDs[i], false);
+            if (rebuild_flag)
+            {
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(operation);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            }
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+    }
+    return tmp_counter;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::Delete_Point_Boxes(vector<BoxPointType> &BoxPoints)
+{
+    Publish_Guard publish_guard(this);
+    if (trace_file != nullptr)
+        record_trace(TRACE_DELETE_BOXES, false, 0, 0, 0, 0, nullptr, 0, BoxPoints.data(), BoxPoints.size());
+#if METRICS_SWITCH
+    auto delete_start = chrono::high_resolution_clock::now();
+#endif
+    int tmp_counter = 0;
+    for (int i = 0; i < BoxPoints.size(); i++)
+    {
+        BoxPointType box = BoxPoints[i];
+        const KD_TREE_Rigid_Transform *box_frame = map_box_frame(box);
+        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+        {
+            tmp_counter += Delete_by_range(&Root_Node, box, true, false, box_frame);
+        }
+        else if (box_frame != nullptr)
+        {
+            // The rebuild thread only replays boxes of the stored frame
+            pthread_mutex_lock(&working_flag_mutex);
+            tmp_counter += delete_points_logged(&Root_Node, box, box_frame, true);
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+        else
+        {
+            Operation_Logger_Type operation{};
+            operation.boxpoint = box;
+            operation.op = DELETE_BOX;
+            pthread_mutex_lock(&working_flag_mutex);
+            tmp_counter += Delete_by_range(&Root_Node, box, false, false);
+            if (rebuild_flag)
+            {
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(operation);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            }
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+    }
+#if METRICS_SWITCH
+    record_metrics(metrics.delete_point_boxes, delete_start);
+#endif
+    return tmp_counter;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::Compact(int max_points, float min_invalid_ratio)
+{
+    Publish_Guard publish_guard(this);
+    if (trace_file != nullptr)
+        record_trace(TRACE_COMPACT, 0, max_points, min_invalid_ratio, 0, 0, nullptr, 0, nullptr, 0);
+    // Deleted points only leave the tree when an update nearby triggers a rebuild. This visits the subtrees holding deleted
+    // points instead and rebuilds the ones with enough of them, until max_points points were rebuilt.
+    if (Root_Node == nullptr || (Rebuild_Ptr != nullptr && *Rebuild_Ptr == Root_Node))
+        return 0;
+#if METRICS_SWITCH
+    auto compact_start = chrono::high_resolution_clock::now();
+#endif
+    int rebuilt_num = Compact_by_ratio(&Root_Node, max_points, min_invalid_ratio);
+#if METRICS_SWITCH
+    record_metrics(metrics.compact, compact_start);
+#endif
+    return rebuilt_num;
+}
+
+#if TIMESTAMP_SWITCH
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::Delete_Older_Than(double min_time)
+{
+    Publish_Guard publish_guard(this);
+    if (trace_file != nullptr)
+        record_trace(TRACE_DELETE_OLDER, 0, 0, 0, 0, 0, nullptr, 0, nullptr, 0, &min_time);
+#if METRICS_SWITCH
+    auto delete_start = chrono::high_resolution_clock::now();
+#endif
+    int tmp_counter = 0;
+    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+    {
+        tmp_counter = Delete_by_time(&Root_Node, min_time, true);
+    }
+    else
+    {
+        Operation_Logger_Type operation{};
+        operation.point_time = min_time;
+        operation.op = DELETE_OLDER;
+        pthread_mutex_lock(&working_flag_mutex);
+        tmp_counter = Delete_by_time(&Root_Node, min_time, false);
+        if (rebuild_flag)
+        {
+            pthread_mutex_lock(&rebuild_logger_mutex_lock);
+            Rebuild_Logger.push(operation);
+            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+        }
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+#if METRICS_SWITCH
+    record_metrics(metrics.delete_older_than, delete_start);
+#endif
+    return tmp_counter;
+}
+#endif
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::Crop_To_Box(const BoxPointType &window)
+{
+    Publish_Guard publish_guard(this);
+    if (trace_file != nullptr)
+        record_trace(TRACE_CROP_BOX, false, 0, 0, 0, 0, nullptr, 0, &window, 1);
+#if METRICS_SWITCH
+    auto delete_start = chrono::high_resolution_clock::now();
+#endif
+    int tmp_counter = 0;
+    BoxPointType box = window;
+    const KD_TREE_Rigid_Transform *box_frame = map_box_frame(box);
+    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+    {
+        tmp_counter = Delete_outside(&Root_Node, box, true, box_frame);
+    }
+    else
+    {
+        pthread_mutex_lock(&working_flag_mutex);
+        tmp_counter = delete_outside_logged(&Root_Node, box, box_frame);
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+#if METRICS_SWITCH
+    record_metrics(metrics.crop_to_box, delete_start);
+#endif
+    return tmp_counter;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::Update_Map_Window(PointType sensor, float half_length, float move_threshold)
+{
+    bool need_move = !map_window_set;
+    for (int i = 0; i < DIM; i++)
+    {
+        float value = Traits::get(sensor, i);
+        if (value - Map_Window.vertex_min[i] < move_threshold || Map_Window.vertex_max[i] - value < move_threshold)
+            need_move = true;
+    }
+    if (!need_move)
+        return 0;
+    for (int i = 0; i < DIM; i++)
+    {
+        Map_Window.vertex_min[i] = Traits::get(sensor, i) - half_length;
+        Map_Window.vertex_max[i] = Traits::get(sensor, i) + half_length;
+    }
+    map_window_set = true;
+    return Crop_To_Box(Map_Window);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::Merge(KD_TREE &&other)
+{
+    vector<uint32_t> New_IDs;
+    return Merge(std::move(other), New_IDs);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::Merge(KD_TREE &&other, vector<uint32_t> &New_IDs)
+{
+    Publish_Guard publish_guard(this);
+    Publish_Guard other_publish_guard(&other);
+    New_IDs.assign(other.next_point_id, INVALID_POINT_ID);
+    if (&other == this)
+        return 0;
+    KD_TREE_NODE *donor = other.release_tree();
+    if (donor == nullptr)
+        return 0;
+    EntryVector traced_entries;
+    if (trace_file != nullptr)
+        other.flatten_storage(donor, traced_entries, NOT_RECORD);
+    // Wait for a rebuild on the rebuild thread to finish, one not started yet is dropped. A rebake is swapped in first, the
+    // points of other are moved into the stored frame it leaves.
+    pthread_mutex_lock(&rebuild_ptr_mutex_lock);
+    finish_rebake();
+    Rebuild_Ptr = nullptr;
+    bake_requested = false;
+    // Under the same rotation the stored frames differ by a shift, which keeps the splits of other. Otherwise its points
+    // are moved one by one.
+    bool same_rotation = memcmp(Map_Transform.rotation, other.Map_Transform.rotation, sizeof(Map_Transform.rotation)) == 0;
+    KD_TREE_Rigid_Transform relative = Map_Transform.inverse().compose(other.Map_Transform);
+    float shift[DIM];
+    for (int i = 0; i < DIM; i++)
+        shift[i] = i < 3 ? relative.translation[i] : 0.0f;
+    auto move_point = [&](const StoredPoint &stored) {
+        PointType point = other.decode_point(stored);
+        if (same_rotation)
+        {
+            for (int i = 0; i < DIM; i++)
+                Traits::set(point, i, Traits::get(point, i) + shift[i]);
+        }
+        else
+        {
+            other.to_map(point);
+            point = to_stored(point);
+        }
+        return point;
+    };
+    bool graftable = same_rotation;
+    int moved_num = 0;
+    bool donor_copied = other.snapshots->shared_below.load() != 0;
+    if (donor_copied)
+    {
+        // A snapshot of other may still read its nodes: the points are copied into new nodes, which keep the graft
+        EntryVector donor_entries, moved_entries;
+        other.flatten_storage(donor, donor_entries, NOT_RECORD);
+        other.delete_tree_nodes(&donor);
+        Point_Entry_Type moved_entry;
+        for (const Point_Entry_Type &entry : donor_entries)
+        {
+            PointType point = move_point(entry.point);
+            if (!point_storage->encode(point, moved_entry.point))
+            {
+                pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);
+                Points_deleted.push_back(point);
+                pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
+                continue;
+            }
+            moved_entry.point_id = assign_point_id(moved_entry.point);
+#if TIMESTAMP_SWITCH
+            moved_entry.point_time = entry.point_time;
+#endif
+            if (entry.point_id < New_IDs.size())
+                New_IDs[entry.point_id] = moved_entry.point_id;
+            moved_entries.push_back(moved_entry);
+        }
+        moved_num = moved_entries.size();
+        if (moved_num == 0)
+        {
+            pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+            return 0;
+        }
+        BuildTree(&donor, 0, moved_num - 1, moved_entries);
+        graftable = true;
+    }
+    // Move the points of other into the storage, ids and frame of this tree. Nodes are visited in preorder, fathers first.
+    vector<KD_TREE_NODE *> donor_nodes;
+    MANUAL_STACK<KD_TREE_NODE *> stack;
+    if (!donor_copied)
+        stack.push(donor);
+    while (!stack.empty())
+    {
+        KD_TREE_NODE *node = stack.pop();
+        other.Push_Down(node);
+        // Counted from now on in the generations of this tree
+        node->generation = snapshots->generation.load(memory_order_relaxed);
+        donor_nodes.push_back(node);
+        PointType point = move_point(node->point);
+        uint32_t old_id = node->point_id;
+        node->point_id = INVALID_POINT_ID;
+        if (!point_storage->encode(point, node->point))
+        {
+            // Not encodable here (out of quantization tiles): removed, and hidden from the removed points of later rebuilds
+            if (!node->point_deleted)
+            {
+                pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);
+                Points_deleted.push_back(point);
+                pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
+            }
+            node->point_deleted = true;
+            node->point_downsample_deleted = true;
+            graftable = false;
+        }
+        else if (!node->point_deleted)
+        {
+            node->point_id = assign_point_id(node->point);
+            if (old_id < New_IDs.size())
+                New_IDs[old_id] = node->point_id;
+            moved_num++;
+        }
+        if (node->left_son_ptr != nullptr)
+            stack.push(node->left_son_ptr);
+        if (node->right_son_ptr != nullptr)
+            stack.push(node->right_son_ptr);
+    }
+    if (graftable)
+    {
+        for (int i = int(donor_nodes.size()) - 1; i >= 0; i--)
+            Update(donor_nodes[i]);
+    }
+    lock_search_exclusive();
+    if (STATIC_ROOT_NODE == nullptr)
+    {
+        STATIC_ROOT_NODE = new KD_TREE_NODE;
+        InitTreeNode(STATIC_ROOT_NODE);
+    }
+    KD_TREE_NODE *guest = donor;
+    if (graftable && (Root_Node == nullptr || donor->TreeSize - donor->invalid_point_num > Root_Node->TreeSize - Root_Node->invalid_point_num))
+    {
+        // The larger tree keeps its nodes and receives the smaller one
+        guest = Root_Node;
+        Root_Node = donor;
+        STATIC_ROOT_NODE->left_son_ptr = Root_Node;
+        Root_Node->father_ptr = STATIC_ROOT_NODE;
+    }
+    KD_TREE_NODE **graft_link = nullptr;
+    if (guest != nullptr && !(graftable && graft_subtree(guest, graft_link)))
+    {
+        // Overlapping ranges: the points of the smaller tree are inserted in spatial order, so that consecutive insertions
+        // go down the same path
+        EntryVector entries;
+        flatten_storage(guest, entries, DELETE_POINTS_REC);
+        delete_tree_nodes(&guest);
+        if (Root_Node == nullptr)
+        {
+            if (entries.size() > 0)
+                BuildTree(&STATIC_ROOT_NODE->left_son_ptr, 0, int(entries.size()) - 1, entries);
+            Root_Node = STATIC_ROOT_NODE->left_son_ptr;
+            if (Root_Node != nullptr)
+                Root_Node->father_ptr = STATIC_ROOT_NODE;
+        }
+        else
+        {
+            spatial_order(entries);
+            for (const Point_Entry_Type &entry : entries)
+            {
+#if TIMESTAMP_SWITCH
+                Add_by_point(&Root_Node, entry.point, entry.point_id, entry.point_time, true, Root_Node->division_axis);
+#else
+                Add_by_point(&Root_Node, entry.point, entry.point_id, INFINITY, true, Root_Node->division_axis);
+#endif
+            }
+        }
+    }
+    unlock_search_exclusive();
+    pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+    // The fathers of a grafted subtree may now be out of balance, the highest of them is rebuilt
+    if (graft_link != nullptr)
+    {
+        KD_TREE_NODE **rebuild_link = nullptr;
+        KD_TREE_NODE *node = *graft_link;
+        while (node != STATIC_ROOT_NODE)
+        {
+            KD_TREE_NODE *father_ptr = node->father_ptr;
+            if (Criterion_Check(node))
+                rebuild_link = father_ptr == STATIC_ROOT_NODE ? &Root_Node : (father_ptr->left_son_ptr == node ? &father_ptr->left_son_ptr : &father_ptr->right_son_ptr);
+            node = father_ptr;
+        }
+        if (rebuild_link != nullptr)
+            Rebuild(rebuild_link);
+    }
+    if (trace_file != nullptr)
+        trace_merge(other, traced_entries, New_IDs);
+    return moved_num;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::trace_merge(const KD_TREE &other, const EntryVector &entries, const vector<uint32_t> &New_IDs)
+{
+    // The points of other in the map frame with the ids they received, which the replay maps its own ids to
+    PointVector points(entries.size());
+    vector<uint32_t> ids(entries.size());
+    vector<double> times;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        points[i] = other.decode_point(entries[i].point);
+        other.to_map(points[i]);
+        ids[i] = entries[i].point_id < New_IDs.size() ? New_IDs[entries[i].point_id] : INVALID_POINT_ID;
+#if TIMESTAMP_SWITCH
+        times.push_back(entries[i].point_time);
+#endif
+    }
+    bool timed = !times.empty();
+    record_trace(TRACE_MERGE, timed ? TRACE_FLAG_TIMED : 0, 0, 0, 0, 0, points.data(), points.size(), nullptr, 0, timed ? times.data() : nullptr, ids.data(), ids.size(), times.size());
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+typename KD_TREE<PointType, DIM, PointStorage>::KD_TREE_NODE *KD_TREE<PointType, DIM, PointStorage>::release_tree()
+{
+    // Takes the whole tree out for Merge. A rebuild on the rebuild thread is waited for, one not started yet is dropped.
+    pthread_mutex_lock(&rebuild_ptr_mutex_lock);
+    finish_rebake();
+    Rebuild_Ptr = nullptr;
+    bake_requested = false;
+    lock_search_exclusive();
+    KD_TREE_NODE *root = Root_Node;
+    Root_Node = nullptr;
+    if (STATIC_ROOT_NODE != nullptr)
+        STATIC_ROOT_NODE->left_son_ptr = nullptr;
+    unlock_search_exclusive();
+    pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+    clear_point_ids();
+    return root;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+bool KD_TREE<PointType, DIM, PointStorage>::graft_subtree(KD_TREE_NODE *guest, KD_TREE_NODE **&graft_link)
+{
+    if (guest->invalid_point_num == guest->TreeSize)
+    {
+        delete_tree_nodes(&guest);
+        return true;
+    }
+    // Go down while the valid points of guest are on one side of the division and the son is larger than guest. Guest
+    // then goes next to the node or into its son, whichever is closer in size. Values equal to a split go right.
+    KD_TREE_NODE **candidates[2] = {&Root_Node, nullptr};
+    KD_TREE_NODE *fathers[2] = {STATIC_ROOT_NODE, nullptr};
+    while (true)
+    {
+        own_node(candidates[0]);
+        KD_TREE_NODE *node = *candidates[0];
+        Push_Down(node);
+        int axis = node->division_axis;
+        float split = point_value(node->point, axis);
+        KD_TREE_NODE **son_link = nullptr;
+        if (guest->node_range[axis][1] < split)
+            son_link = &node->left_son_ptr;
+        else if (guest->node_range[axis][0] >= split)
+            son_link = &node->right_son_ptr;
+        if (son_link == nullptr)
+            break;
+        if (*son_link != nullptr && (*son_link)->TreeSize >= guest->TreeSize)
+        {
+            candidates[0] = son_link;
+            fathers[0] = node;
+            continue;
+        }
+        candidates[1] = son_link;
+        fathers[1] = node;
+        if (*son_link == nullptr || node->TreeSize - guest->TreeSize > guest->TreeSize - (*son_link)->TreeSize)
+        {
+            swap(candidates[0], candidates[1]);
+            swap(fathers[0], fathers[1]);
+        }
+        break;
+    }
+    for (int c = 0; c < 2; c++)
+    {
+        KD_TREE_NODE **candidate = candidates[c];
+        if (candidate == nullptr)
+            continue;
+        KD_TREE_NODE *sibling = *candidate;
+        if (sibling == nullptr)
+        {
+            // An empty cell, guest becomes the son
+            *candidate = guest;
+        }
+        else
+        {
+            // A new node divides sibling and guest on the axis with the widest gap
+            int gap_axis = -1;
+            bool guest_right = true;
+            float gap = 0.0f;
+            // A sibling without valid points has nothing to keep apart
+            bool sibling_empty = sibling->invalid_point_num == sibling->TreeSize;
+            if (sibling_empty)
+                gap_axis = 0;
+            for (int i = 0; i < DIM && !sibling_empty; i++)
+            {
+                if (guest->node_range[i][0] - sibling->node_range[i][1] > gap)
+                {
+                    gap = guest->node_range[i][0] - sibling->node_range[i][1];
+                    gap_axis = i;
+                    guest_right = true;
+                }
+                if (sibling->node_range[i][0] - guest->node_range[i][1] > gap)
+                {
+                    gap = sibling->node_range[i][0] - guest->node_range[i][1];
+                    gap_axis = i;
+                    guest_right = false;
+                }
+            }
+            if (gap_axis < 0)
+                continue;
+            // The point of guest nearest to sibling on the gap axis divides them: it is taken out and guest rebuilt without
+            // it. Values equal to a split go right, so a guest on the left must have that point alone at its largest value.
+            EntryVector entries;
+            flatten_storage(guest, entries, NOT_RECORD);
+            if (entries.empty())
+            {
+                delete_tree_nodes(&guest);
+                return true;
+            }
+            size_t divider = 0;
+            int tie_num = 0;
+            for (size_t k = 1; k < entries.size(); k++)
+            {
+                float value = point_value(entries[k].point, gap_axis), best = point_value(entries[divider].point, gap_axis);
+                if (value == best)
+                    tie_num++;
+                if (guest_right ? value < best : value > best)
+                {
+                    divider = k;
+                    tie_num = 0;
+                }
+            }
+            if (!guest_right && tie_num > 0)
+                continue;
+            KD_TREE_NODE *split_node = new KD_TREE_NODE;
+            InitTreeNode(split_node);
+            split_node->point = entries[divider].point;
+            split_node->point_id = entries[divider].point_id;
+#if TIMESTAMP_SWITCH
+            split_node->point_time = entries[divider].point_time;
+#endif
+            split_node->division_axis = gap_axis;
+            entries[divider] = entries.back();
+            entries.pop_back();
+            delete_tree_nodes(&guest);
+            if (!entries.empty())
+                BuildTree(&guest, 0, int(entries.size()) - 1, entries);
+            split_node->left_son_ptr = guest_right ? sibling : guest;
+            split_node->right_son_ptr = guest_right ? guest : sibling;
+            Update(split_node);
+            *candidate = split_node;
+        }
+        (*candidate)->father_ptr = fathers[c];
+        if (candidate == &Root_Node)
+            STATIC_ROOT_NODE->left_son_ptr = Root_Node;
+        for (KD_TREE_NODE *node = fathers[c]; node != STATIC_ROOT_NODE; node = node->father_ptr)
+            Update(node);
+        graft_link = candidate;
+        return true;
+    }
+    return false;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::spatial_order(EntryVector &Storage)
+{
+    // Median splits on the longest axis, as in BuildTree, down to runs of a few points
+    MANUAL_STACK<pair<int, int>> ranges;
+    ranges.push(make_pair(0, int(Storage.size()) - 1));
+    while (!ranges.empty())
+    {
+        pair<int, int> range = ranges.pop();
+        int l = range.first, r = range.second;
+        if (r - l < 16)
+            continue;
+        float min_value[DIM], max_value[DIM];
+        for (int axis = 0; axis < DIM; axis++)
+        {
+            min_value[axis] = INFINITY;
+            max_value[axis] = -INFINITY;
+        }
+        for (int i = l; i <= r; i++)
+        {
+            for (int axis = 0; axis < DIM; axis++)
+            {
+                min_value[axis] = min(min_value[axis], point_value(Storage[i].point, axis));
+                max_value[axis] = max(max_value[axis], point_value(Storage[i].point, axis));
+            }
+        }
+        int div_axis = 0;
+        for (int axis = 1; axis < DIM; axis++)
+            if (max_value[axis] - min_value[axis] > max_value[div_axis] - min_value[div_axis])
+                div_axis = axis;
+        int mid = (l + r) >> 1;
+        nth_element(begin(Storage) + l, begin(Storage) + mid, begin(Storage) + r + 1, Point_Axis_CMP(point_storage.get(), div_axis));
+        ranges.push(make_pair(mid + 1, r));
+        ranges.push(make_pair(l, mid - 1));
+    }
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::Extract(const BoxPointType &box, KD_TREE &region, bool remove)
+{
+    Publish_Guard publish_guard(this);
+    Publish_Guard region_publish_guard(&region);
+    if (&region == this)
+        return 0;
+    BoxPointType boxpoint = box;
+    const KD_TREE_Rigid_Transform *box_frame = map_box_frame(boxpoint);
+    EntryVector points;
+    vector<KD_TREE_NODE *> subtrees;
+    if (remove)
+    {
+        // The source side of a removing extract replays as a box delete
+        if (trace_file != nullptr)
+            record_trace(TRACE_DELETE_BOXES, false, 0, 0, 0, 0, nullptr, 0, &box, 1);
+        // Subtrees inside the box are cut off and flattened afterwards, then freed on the rebuild thread, which reports
+        // their points as removed like those of a box delete
+        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+            Extract_by_range(&Root_Node, boxpoint, true, points, subtrees, box_frame);
+        else
+            extract_logged(&Root_Node, boxpoint, points, subtrees, box_frame);
+        flatten_subtrees(subtrees, points);
+        pthread_mutex_lock(&detached_trees_mutex_lock);
+        for (KD_TREE_NODE *subtree : subtrees)
+            Detached_Trees.push_back(make_pair(subtree, bake_epoch));
+        pthread_mutex_unlock(&detached_trees_mutex_lock);
+    }
+    else if (Rebuild_Ptr == nullptr)
+    {
+        // No rebuild runs or starts until this returns, so the subtrees found stay in place while they are flattened
+        Search_by_range(&Root_Node, boxpoint, points, box_frame, &subtrees);
+        flatten_subtrees(subtrees, points);
+    }
+    else
+    {
+        Search_by_range(&Root_Node, boxpoint, points, box_frame);
+    }
+    // The region is built from the points in its own storage and frame, their timestamps are kept
+    KD_TREE_NODE *old_root = region.release_tree();
+    region.delete_tree_nodes(&old_root);
+    EntryVector region_points;
+    region_points.reserve(points.size());
+    Point_Entry_Type region_entry;
+    for (const Point_Entry_Type &entry : points)
+    {
+        PointType point = decode_point(entry.point);
+        to_map(point);
+        if (!region.point_storage->encode(region.to_stored(point), region_entry.point))
+            continue;
+        region_entry.point_id = region.assign_point_id(region_entry.point);
+#if TIMESTAMP_SWITCH
+        region_entry.point_time = entry.point_time;
+#endif
+        region_points.push_back(region_entry);
+    }
+    KD_TREE_NODE *new_root = nullptr;
+    if (region_points.size() > 0)
+        region.BuildTree(&new_root, 0, int(region_points.size()) - 1, region_points);
+    region.lock_search_exclusive();
+    if (region.STATIC_ROOT_NODE == nullptr)
+    {
+        region.STATIC_ROOT_NODE = new KD_TREE_NODE;
+        region.InitTreeNode(region.STATIC_ROOT_NODE);
+    }
+    region.STATIC_ROOT_NODE->left_son_ptr = new_root;
+    region.Root_Node = new_root;
+    if (new_root != nullptr)
+    {
+        new_root->father_ptr = region.STATIC_ROOT_NODE;
+        region.Update(region.STATIC_ROOT_NODE);
+        region.STATIC_ROOT_NODE->TreeSize = 0;
+    }
+    region.unlock_search_exclusive();
+    return region_points.size();
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void *KD_TREE<PointType, DIM, PointStorage>::extract_thread_ptr(void *arg)
+{
+    Extract_Task *task = (Extract_Task *)arg;
+    for (KD_TREE_NODE *subtree : task->subtrees)
+        task->tree->flatten_storage(subtree, task->points, NOT_RECORD);
+    return nullptr;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::flatten_subtrees(vector<KD_TREE_NODE *> &Subtrees, EntryVector &Storage)
+{
+    // The subtrees are disjoint, so their push-downs don't meet. Each goes to the least loaded thread, largest first, the
+    // calling thread takes the first share.
+    int point_num = 0;
+    for (KD_TREE_NODE *subtree : Subtrees)
+        point_num += subtree->TreeSize;
+    int thread_num = 1;
+    if (point_num >= Multi_Thread_Extract_Point_Num)
+        thread_num = max(1, min(min(int(Subtrees.size()), Extract_Thread_Num), int(sysconf(_SC_NPROCESSORS_ONLN))));
+    vector<Extract_Task> tasks(thread_num);
+    vector<int> task_size(thread_num, 0);
+    sort(Subtrees.begin(), Subtrees.end(), [](const KD_TREE_NODE *a, const KD_TREE_NODE *b) { return a->TreeSize > b->TreeSize; });
+    for (KD_TREE_NODE *subtree : Subtrees)
+    {
+        int i = min_element(task_size.begin(), task_size.end()) - task_size.begin();
+        tasks[i].subtrees.push_back(subtree);
+        task_size[i] += subtree->TreeSize;
+    }
+    vector<pthread_t> threads(thread_num);
+    vector<bool> started(thread_num, false);
+    for (int i = 0; i < thread_num; i++)
+    {
+        tasks[i].tree = this;
+        tasks[i].points.reserve(task_size[i]);
+        if (i > 0)
+            started[i] = pthread_create(&threads[i], NULL, extract_thread_ptr, (void *)&tasks[i]) == 0;
+    }
+    for (int i = 0; i < thread_num; i++)
+    {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            extract_thread_ptr((void *)&tasks[i]);
+        Storage.insert(Storage.end(), tasks[i].points.begin(), tasks[i].points.end());
+    }
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::Extract_by_range(KD_TREE_NODE **root, const BoxPointType &boxpoint, bool allow_rebuild, EntryVector &Storage, vector<KD_TREE_NODE *> &Subtrees, const KD_TREE_Rigid_Transform *box_frame)
+{
+    // Delete_by_range that also takes the points deleted
+    if ((*root) == nullptr || (*root)->tree_deleted)
+        return 0;
+    own_node(root);
+    (*root)->working_flag = true;
+    Push_Down(*root);
+    int tmp_counter = 0;
+    if (box_outside(boxpoint, (*root), box_frame))
+    {
+        (*root)->working_flag = false;
+        return 0;
+    }
+    if (box_contains(boxpoint, (*root), box_frame))
+    {
+        tmp_counter = (*root)->TreeSize - (*root)->invalid_point_num;
+        if (allow_rebuild && (*root)->TreeSize >= Minimal_Unbalanced_Tree_Size && root != &Root_Node && detach_subtree(root, &Subtrees))
+            return tmp_counter;
+        // Walked as a search, which locks the subtree on the rebuild thread if this one holds it
+        Search_by_range(root, boxpoint, Storage, box_frame);
+        (*root)->tree_deleted = true;
+        (*root)->point_deleted = true;
+        (*root)->need_push_down_to_left = true;
+        (*root)->need_push_down_to_right = true;
+        (*root)->invalid_point_num = (*root)->TreeSize;
+        (*root)->working_flag = false;
+        return tmp_counter;
+    }
+    if (!(*root)->point_deleted && box_contains_point(boxpoint, (*root)->point, box_frame))
+    {
+        push_storage(Storage, *root);
+        (*root)->point_deleted = true;
+        tmp_counter += 1;
+    }
+    KD_TREE_NODE **son_links[2] = {&(*root)->left_son_ptr, &(*root)->right_son_ptr};
+    for (KD_TREE_NODE **son_link : son_links)
+    {
+        if ((Rebuild_Ptr == nullptr) || *son_link != *Rebuild_Ptr)
+            tmp_counter += Extract_by_range(son_link, boxpoint, allow_rebuild, Storage, Subtrees, box_frame);
+        else
+            tmp_counter += extract_logged(son_link, boxpoint, Storage, Subtrees, box_frame);
+    }
+    Update(*root);
+    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num && !bake_requested)
+        Rebuild_Ptr = nullptr;
+    bool need_rebuild = allow_rebuild & Criterion_Check((*root));
+    if (need_rebuild)
+        Rebuild(root);
+    if ((*root) != nullptr)
+        (*root)->working_flag = false;
+    return tmp_counter;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::extract_logged(KD_TREE_NODE **root, const BoxPointType &boxpoint, EntryVector &Storage, vector<KD_TREE_NODE *> &Subtrees, const KD_TREE_Rigid_Transform *box_frame)
+{
+    // The subtree on the rebuild thread: its points are taken under working_flag_mutex and the delete is logged for the
+    // rebuilt copy, as a box, or point by point for a box in the map frame
+    int tmp_counter = 0;
+    pthread_mutex_lock(&working_flag_mutex);
+    if (box_frame != nullptr)
+    {
+        Search_by_range(root, boxpoint, Storage, box_frame);
+        tmp_counter = delete_points_logged(root, boxpoint, box_frame, true);
+    }
+    else
+    {
+        tmp_counter = Extract_by_range(root, boxpoint, false, Storage, Subtrees);
+        if (rebuild_flag)
+        {
+            Operation_Logger_Type operation{};
+            operation.boxpoint = boxpoint;
+            operation.op = DELETE_BOX;
+            pthread_mutex_lock(&rebuild_logger_mutex_lock);
+            Rebuild_Logger.push(operation);
+            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+        }
+    }
+    pthread_mutex_unlock(&working_flag_mutex);
+    return tmp_counter;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+bool KD_TREE<PointType, DIM, PointStorage>::Set_Map_Transform(const KD_TREE_Rigid_Transform &transform)
+{
+    Publish_Guard publish_guard(this);
+    if (trace_file != nullptr)
+        record_trace(TRACE_SET_TRANSFORM, 0, 0, 0, 0, 0, nullptr, 0, nullptr, 0, nullptr, nullptr, 0, 0, &transform);
+    if (DIM != 3)
+        return false;
+    finish_rebake();
+    Map_Transform = transform;
+    Map_Transform.orthonormalize();
+    map_rotated = Map_Transform.has_rotation();
+    map_transformed = map_rotated || Map_Transform.has_translation();
+    return true;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+bool KD_TREE<PointType, DIM, PointStorage>::Apply_Map_Transform(const KD_TREE_Rigid_Transform &correction)
+{
+    return Set_Map_Transform(correction.compose(Map_Transform));
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+bool KD_TREE<PointType, DIM, PointStorage>::Rebake()
+{
+    Writer_Guard writer_guard(this);
+    if (trace_file != nullptr)
+        record_trace(TRACE_REBAKE, 0, 0, 0, 0, 0, nullptr, 0, nullptr, 0);
+    if (DIM != 3)
+        return false;
+    finish_rebake();
+    if (bake_requested)
+        return false;
+    if (Root_Node == nullptr || !map_transformed)
+        return true;
+    if (pthread_mutex_trylock(&rebuild_ptr_mutex_lock))
+        return false;
+    // Not next to another rebuild, whose subtree would be replaced underneath it
+    bool start = Rebuild_Ptr == nullptr;
+    if (start)
+    {
+        Bake_Transform = Map_Transform;
+        bake_requested = true;
+        if (Root_Node->TreeSize >= Multi_Thread_Rebuild_Point_Num)
+            Rebuild_Ptr = &Root_Node;
+    }
+    pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+    if (start && Rebuild_Ptr == nullptr)
+    {
+        // Small trees are rebaked right here
+        Rebuild_Entry_Storage.clear();
+        flatten_storage(Root_Node, Rebuild_Entry_Storage, DELETE_POINTS_REC);
+        bake_storage(Rebuild_Entry_Storage);
+        lock_search_exclusive();
+        delete_tree_nodes(&Root_Node);
+        BuildTree(&STATIC_ROOT_NODE->left_son_ptr, 0, int(Rebuild_Entry_Storage.size()) - 1, Rebuild_Entry_Storage);
+        Root_Node = STATIC_ROOT_NODE->left_son_ptr;
+        if (Root_Node != nullptr)
+            Root_Node->father_ptr = STATIC_ROOT_NODE;
+        Baked_Root = Root_Node;
+        unlock_search_exclusive();
+        bake_ready = true;
+        finish_rebake();
+    }
+    return start;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::finish_rebake()
+{
+    if (!bake_ready)
+        return;
+    // The rebuild thread has left the rebaked tree in Baked_Root. The operations logged since are replayed onto it here
+    // and the trees are swapped, all in the writer, so that no update sees the tree and the transform disagree.
+    KD_TREE_NODE *old_root_node = nullptr;
+    pthread_mutex_lock(&working_flag_mutex);
+    if (Baked_Root != Root_Node)
+    {
+        pthread_mutex_lock(&rebuild_logger_mutex_lock);
+        while (!Rebuild_Logger.empty())
+        {
+            run_operation(&Baked_Root, Rebuild_Logger.front(), &Bake_Transform);
+            Rebuild_Logger.pop();
+        }
+        pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+        lock_search_exclusive();
+        old_root_node = Root_Node;
+        STATIC_ROOT_NODE->left_son_ptr = Baked_Root;
+        Root_Node = Baked_Root;
+        if (Root_Node != nullptr)
+            Root_Node->father_ptr = STATIC_ROOT_NODE;
+        unlock_search_exclusive();
+    }
+    // Everything kept in the stored frame moves along
+    for (vector<float> &page : ID_Pages)
+    {
+        for (size_t i = 0; i + DIM <= page.size(); i += DIM)
+            bake_coordinate(&page[i], &page[i]);
+    }
+    pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);
+    for (PointType &point : Points_deleted)
+        transform_point(point, Bake_Transform, false);
+    for (PointType &point : Multithread_Points_deleted)
+        transform_point(point, Bake_Transform, false);
+    bake_epoch++;
+    pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
+    // Unless the map was moved meanwhile, the points are now stored in the map frame
+    if (memcmp(&Map_Transform, &Bake_Transform, sizeof(Map_Transform)) == 0)
+        Map_Transform = KD_TREE_Rigid_Transform();
+    else
+        Map_Transform = Map_Transform.compose(Bake_Transform.inverse());
+    Map_Transform.orthonormalize();
+    map_rotated = Map_Transform.has_rotation();
+    map_transformed = map_rotated || Map_Transform.has_translation();
+    Baked_Root = nullptr;
+    bake_ready = false;
+    bake_requested = false;
+    if (old_root_node != nullptr)
+    {
+        Rebuild_Ptr = nullptr;
+        rebuild_flag = false;
+        pthread_mutex_lock(&detached_trees_mutex_lock);
+        Discarded_Trees.push_back(old_root_node);
+        pthread_mutex_unlock(&detached_trees_mutex_lock);
+    }
+    pthread_mutex_unlock(&working_flag_mutex);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::bake_storage(EntryVector &Storage)
+{
+    // Points the storage can't encode in the new frame (out of quantization tiles) are dropped as removed
+    size_t kept_num = 0;
+    for (size_t i = 0; i < Storage.size(); i++)
+    {
+        StoredPoint stored = Storage[i].point;
+        if (transform_stored(Storage[i].point, Bake_Transform))
+        {
+            Storage[kept_num++] = Storage[i];
+        }
+        else
+        {
+            pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);
+            Multithread_Points_deleted.push_back(decode_point(stored));
+            pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
+        }
+    }
+    Storage.resize(kept_num);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+bool KD_TREE<PointType, DIM, PointStorage>::transform_stored(StoredPoint &point, const KD_TREE_Rigid_Transform &transform)
+{
+    PointType decoded = decode_point(point);
+    transform_point(decoded, transform, false);
+    return point_storage->encode(decoded, point);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::bake_coordinate(const float *coordinate, float *baked)
+{
+    // Goes through the storage like the baked point does, so that Delete_by_id still finds it
+    PointType point;
+    for (int i = 0; i < DIM; i++)
+        Traits::set(point, i, coordinate[i]);
+    transform_point(point, Bake_Transform, false);
+    StoredPoint stored;
+    bool encoded = point_storage->encode(point, stored);
+    for (int i = 0; i < DIM; i++)
+        baked[i] = encoded ? point_value(stored, i) : Traits::get(point, i);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::transform_point(PointType &point, const KD_TREE_Rigid_Transform &transform, bool inverse) const
+{
+    // Only the first three axes move, trees of other dimensions have no map transform
+    if (DIM < 3)
+        return;
+    float value[3] = {Traits::get(point, 0), Traits::get(point, 1), Traits::get(point, 2)}, moved[3];
+    if (inverse)
+        transform.apply_inverse(value, moved);
+    else
+        transform.apply(value, moved);
+    for (int i = 0; i < 3; i++)
+        Traits::set(point, i, moved[i]);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+PointType KD_TREE<PointType, DIM, PointStorage>::to_stored(const PointType &point) const
+{
+    PointType stored = point;
+    if (map_transformed)
+        transform_point(stored, Map_Transform, true);
+    return stored;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::to_map(PointType &point) const
+{
+    if (map_transformed)
+        transform_point(point, Map_Transform, false);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::to_map(PointVector &points, size_t begin) const
+{
+    if (map_transformed)
+        for (size_t i = begin; i < points.size(); i++)
+            transform_point(points[i], Map_Transform, false);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+const KD_TREE_Rigid_Transform *KD_TREE<PointType, DIM, PointStorage>::map_box_frame(BoxPointType &box) const
+{
+    // A box in the map frame is still a box in the stored frame if the map is only shifted
+    if (map_rotated)
+        return &Map_Transform;
+    if (map_transformed)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            box.vertex_min[i] -= Map_Transform.translation[i];
+            box.vertex_max[i] -= Map_Transform.translation[i];
+        }
+    }
+    return nullptr;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::to_map(Plane_Fit &plane) const
+{
+    if (!map_transformed)
+        return;
+    float normal[3];
+    for (int i = 0; i < 3; i++)
+        normal[i] = Map_Transform.rotation[i][0] * plane.normal[0] + Map_Transform.rotation[i][1] * plane.normal[1] + Map_Transform.rotation[i][2] * plane.normal[2];
+    for (int i = 0; i < 3; i++)
+    {
+        plane.normal[i] = normal[i];
+        plane.d -= normal[i] * Map_Transform.translation[i];
+    }
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::acquire_removed_points(PointVector &removed_points)
+{
+    size_t begin = removed_points.size();
+    pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);
+    for (int i = 0; i < Points_deleted.size(); i++)
+    {
+        removed_points.push_back(Points_deleted[i]);
+    }
+    for (int i = 0; i < Multithread_Points_deleted.size(); i++)
+    {
+        removed_points.push_back(Multithread_Points_deleted[i]);
+    }
+    Points_deleted.clear();
+    Multithread_Points_deleted.clear();
+    pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
+    to_map(removed_points, begin);
+    return;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::BuildTree(KD_TREE_NODE **root, int l, int r, EntryVector &Storage)
+{
+    if (l > r)
+        return;
+    /*
+        All nodes are taken from one array, in blocked breadth-first order: the top Node_Block_Level_Num
+        levels of a subtree are laid out breadth-first, followed by the groups hanging below them.
+        A descent then stays within one group, a few neighboring cache lines, for that many levels.
+    */
+    Node_Block *block = new Node_Block;
+    block->nodes = new KD_TREE_NODE[r - l + 1];
+    block->live_num = r - l + 1;
+    int node_num = 0;
+    queue<Build_Task> group_roots, group_tasks;
+    group_roots.push(Build_Task{root, l, r, 0});
+    while (!group_roots.empty())
+    {
+        group_tasks.push(group_roots.front());
+        group_roots.pop();
+        while (!group_tasks.empty())
+        {
+            Build_Task task = group_tasks.front();
+            group_tasks.pop();
+            KD_TREE_NODE *node = &block->nodes[node_num++];
+            InitTreeNode(node);
+            node->block = block;
+            *task.link = node;
+            int mid = (task.l + task.r) >> 1;
+            int div_axis = 0;
+            int i;
+            // Find the best division Axis
+            float min_value[DIM], max_value[DIM], dim_range[DIM];
+            for (i = 0; i < DIM; i++)
+            {
+                min_value[i] = INFINITY;
+                max_value[i] = -INFINITY;
+            }
+            for (i = task.l; i <= task.r; i++)
+            {
+                for (int axis = 0; axis < DIM; axis++)
+                {
+                    min_value[axis] = min(min_value[axis], point_value(Storage[i].point, axis));
+                    max_value[axis] = max(max_value[axis], point_value(Storage[i].point, axis));
+                }
+            }
+            // Select the longest dimension as division axis
+            for (i = 0; i < DIM; i++)
+                dim_range[i] = max_value[i] - min_value[i];
+            for (i = 1; i < DIM; i++)
+                if (dim_range[i] > dim_range[div_axis])
+                    div_axis = i;
+            // Divide by the division axis, the two halves are built later in the layout order
+            node->division_axis = div_axis;
+            nth_element(begin(Storage) + task.l, begin(Storage) + mid, begin(Storage) + task.r + 1, Point_Axis_CMP(point_storage.get(), div_axis));
+            node->point = Storage[mid].point;
+            node->point_id = Storage[mid].point_id;
+#if TIMESTAMP_SWITCH
+            node->point_time = Storage[mid].point_time;
+#endif
+            Build_Task left_task{&node->left_son_ptr, task.l, mid - 1, task.depth + 1};
+            Build_Task right_task{&node->right_son_ptr, mid + 1, task.r, task.depth + 1};
+            queue<Build_Task> &next_tasks = task.depth + 1 < Node_Block_Level_Num ? group_tasks : group_roots;
+            if (left_task.l <= left_task.r)
+            {
+                left_task.depth %= Node_Block_Level_Num;
+                next_tasks.push(left_task);
+            }
+            if (right_task.l <= right_task.r)
+            {
+                right_task.depth %= Node_Block_Level_Num;
+                next_tasks.push(right_task);
+            }
+        }
+    }
+    // Every node comes after its father, so in reverse order the sons are always updated first
+    for (int i = node_num - 1; i >= 0; i--)
+        Update(&block->nodes[i]);
+    return;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Rebuild(KD_TREE_NODE **root)
+{
+    KD_TREE_NODE *father_ptr;
+    if ((*root)->TreeSize >= Multi_Thread_Rebuild_Point_Num)
+    {
+        if (!pthread_mutex_trylock(&rebuild_ptr_mutex_lock))
+        {
+            if (Rebuild_Ptr == nullptr || ((*root)->TreeSize > (*Rebuild_Ptr)->TreeSize))
+            {
+                Rebuild_Ptr = root;
+            }
+            pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+        }
+    }
+    else
+    {
+#if METRICS_SWITCH
+        auto rebuild_start = chrono::high_resolution_clock::now();
+#endif
+        father_ptr = (*root)->father_ptr;
+        Rebuild_Entry_Storage.clear();
+        flatten_storage(*root, Rebuild_Entry_Storage, DELETE_POINTS_REC);
+        delete_tree_nodes(root);
+        BuildTree(root, 0, Rebuild_Entry_Storage.size() - 1, Rebuild_Entry_Storage);
+        if (*root != nullptr)
+            (*root)->father_ptr = father_ptr;
+        if (*root == Root_Node)
+            STATIC_ROOT_NODE->left_son_ptr = *root;
+#if METRICS_SWITCH
+        record_metrics(metrics.sync_rebuild, rebuild_start);
+#endif
+    }
+    return;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::Compact_by_ratio(KD_TREE_NODE **root, int max_points, float min_invalid_ratio)
+{
+    KD_TREE_NODE *node = *root;
+    if (node == nullptr || node->invalid_point_num == 0 || node->TreeSize <= Minimal_Unbalanced_Tree_Size || max_points <= Minimal_Unbalanced_Tree_Size)
+        return 0;
+    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == node)
+        return 0;
+    own_node(root);
+    node = *root;
+    node->working_flag = true;
+    Push_Down(node);
+    int rebuilt_num = 0;
+    // Only one subtree at a time goes to the rebuild thread
+    bool multi_thread = node->TreeSize >= Multi_Thread_Rebuild_Point_Num;
+    if (float(node->invalid_point_num) / node->TreeSize >= min_invalid_ratio && node->TreeSize <= max_points && !(multi_thread && Rebuild_Ptr != nullptr))
+    {
+        // The largest subtree on the path that is worth it: rebuilt here if small, handed to the rebuild thread otherwise
+        int size_rec = node->TreeSize;
+        Rebuild(root);
+        if (!multi_thread || (Rebuild_Ptr != nullptr && *Rebuild_Ptr == node))
+            rebuilt_num = size_rec;
+    }
+    else
+    {
+        // Otherwise look into the sons, the one with more deleted points first
+        KD_TREE_NODE **son_links[2] = {&node->left_son_ptr, &node->right_son_ptr};
+        if (node->left_son_ptr == nullptr || (node->right_son_ptr != nullptr && node->right_son_ptr->invalid_point_num > node->left_son_ptr->invalid_point_num))
+            swap(son_links[0], son_links[1]);
+        for (KD_TREE_NODE **son_link : son_links)
+        {
+            if ((Rebuild_Ptr == nullptr) || *son_link != *Rebuild_Ptr)
+                rebuilt_num += Compact_by_ratio(son_link, max_points - rebuilt_num, min_invalid_ratio);
+        }
+        Update(node);
+    }
+    if ((*root) != nullptr)
+        (*root)->working_flag = false;
+    return rebuilt_num;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::Delete_by_range(KD_TREE_NODE **root, BoxPointType boxpoint, bool allow_rebuild, bool is_downsample, const KD_TREE_Rigid_Transform *box_frame)
+{
+    if ((*root) == nullptr || (*root)->tree_deleted)
+        return 0;
+    own_node(root);
+    (*root)->working_flag = true;
+    Push_Down(*root);
+    int tmp_counter = 0;
+    if (box_outside(boxpoint, (*root), box_frame))
+        return 0;
+    if (box_contains(boxpoint, (*root), box_frame))
+    {
+        // Large subtrees are cut off if pruning is on. Not in the subtree on the rebuild thread or in its copy
+        // (allow_rebuild is false there), where working_flag_mutex is held or the copy is not linked in yet.
+        if (allow_rebuild && !is_downsample && prune_min_size > 0 && (*root)->TreeSize >= prune_min_size && root != &Root_Node)
+        {
+            tmp_counter = (*root)->TreeSize - (*root)->invalid_point_num;
+            if (detach_subtree(root))
+                return tmp_counter;
+        }
+        (*root)->tree_deleted = true;
+        (*root)->point_deleted = true;
+        (*root)->need_push_down_to_left = true;
+        (*root)->need_push_down_to_right = true;
+        tmp_counter = (*root)->TreeSize - (*root)->invalid_point_num;
+        (*root)->invalid_point_num = (*root)->TreeSize;
+        if (is_downsample)
+        {
+            (*root)->tree_downsample_deleted = true;
+            (*root)->point_downsample_deleted = true;
+            (*root)->down_del_num = (*root)->TreeSize;
+        }
+        return tmp_counter;
+    }
+    if (!(*root)->point_deleted && box_contains_point(boxpoint, (*root)->point, box_frame))
+    {
+        (*root)->point_deleted = true;
+        tmp_counter += 1;
+        if (is_downsample)
+            (*root)->point_downsample_deleted = true;
+    }
+    Operation_Logger_Type delete_box_log{};
+    struct timespec Timeout;
+    if (is_downsample)
+        delete_box_log.op = DOWNSAMPLE_DELETE;
+    else
+        delete_box_log.op = DELETE_BOX;
+    delete_box_log.boxpoint = boxpoint;
+    if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr)
+    {
+        tmp_counter += Delete_by_range(&((*root)->left_son_ptr), boxpoint, allow_rebuild, is_downsample, box_frame);
+    }
+    else
+    {
+        pthread_mutex_lock(&working_flag_mutex);
+        if (box_frame != nullptr)
+        {
+            tmp_counter += delete_points_logged(&((*root)->left_son_ptr), boxpoint, box_frame, true);
+        }
+        else
+        {
+            tmp_counter += Delete_by_range(&((*root)->left_son_ptr), boxpoint, false, is_downsample);
+            if (rebuild_flag)
+            {
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(delete_box_log);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            }
+        }
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr)
+    {
+        tmp_counter += Delete_by_range(&((*root)->right_son_ptr), boxpoint, allow_rebuild, is_downsample, box_frame);
+    }
+    else
+    {
+        pthread_mutex_lock(&working_flag_mutex);
+        if (box_frame != nullptr)
+        {
+            tmp_counter += delete_points_logged(&((*root)->right_son_ptr), boxpoint, box_frame, true);
+        }
+        else
+        {
+            tmp_counter += Delete_by_range(&((*root)->right_son_ptr), boxpoint, false, is_downsample);
+            if (rebuild_flag)
+            {
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(delete_box_log);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            }
+        }
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    Update(*root);
+    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num && !bake_requested)
+        Rebuild_Ptr = nullptr;
+    bool need_rebuild = allow_rebuild & Criterion_Check((*root));
+    if (need_rebuild)
+        Rebuild(root);
+    if ((*root) != nullptr)
+        (*root)->working_flag = false;
+    return tmp_counter;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::Delete_by_time(KD_TREE_NODE **root, double min_time, bool allow_rebuild)
+{
+#if TIMESTAMP_SWITCH
+    if ((*root) == nullptr || (*root)->tree_deleted)
+        return 0;
+    own_node(root);
+    (*root)->working_flag = true;
+    Push_Down(*root);
+    int tmp_counter = 0;
+    if ((*root)->time_range[0] >= min_time)
+    {
+        (*root)->working_flag = false;
+        return 0;
+    }
+    if ((*root)->time_range[1] < min_time)
+    {
+        // Every valid point below is older, as for a box containing the subtree
+        if (allow_rebuild && prune_min_size > 0 && (*root)->TreeSize >= prune_min_size && root != &Root_Node)
+        {
+            tmp_counter = (*root)->TreeSize - (*root)->invalid_point_num;
+            if (detach_subtree(root))
+                return tmp_counter;
+        }
+        (*root)->tree_deleted = true;
+        (*root)->point_deleted = true;
+        (*root)->need_push_down_to_left = true;
+        (*root)->need_push_down_to_right = true;
+        tmp_counter = (*root)->TreeSize - (*root)->invalid_point_num;
+        (*root)->invalid_point_num = (*root)->TreeSize;
+        (*root)->working_flag = false;
+        return tmp_counter;
+    }
+    if (!(*root)->point_deleted && (*root)->point_time < min_time)
+    {
+        (*root)->point_deleted = true;
+        tmp_counter += 1;
+    }
+    Operation_Logger_Type delete_log{};
+    delete_log.op = DELETE_OLDER;
+    delete_log.point_time = min_time;
+    KD_TREE_NODE **son_links[2] = {&(*root)->left_son_ptr, &(*root)->right_son_ptr};
+    for (KD_TREE_NODE **son_link : son_links)
+    {
+        if ((Rebuild_Ptr == nullptr) || *son_link != *Rebuild_Ptr)
+        {
+            tmp_counter += Delete_by_time(son_link, min_time, allow_rebuild);
+        }
+        else
+        {
+            pthread_mutex_lock(&working_flag_mutex);
+            tmp_counter += Delete_by_time(son_link, min_time, false);
+            if (rebuild_flag)
+            {
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(delete_log);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            }
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+    }
+    Update(*root);
+    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num && !bake_requested)
+        Rebuild_Ptr = nullptr;
+    bool need_rebuild = allow_rebuild & Criterion_Check((*root));
+    if (need_rebuild)
+        Rebuild(root);
+    if ((*root) != nullptr)
+        (*root)->working_flag = false;
+    return tmp_counter;
+#else
+    return 0;
+#endif
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::Delete_outside(KD_TREE_NODE **root, const BoxPointType &window, bool allow_rebuild, const KD_TREE_Rigid_Transform *box_frame)
+{
+    if ((*root) == nullptr || (*root)->tree_deleted)
+        return 0;
+    own_node(root);
+    (*root)->working_flag = true;
+    Push_Down(*root);
+    int tmp_counter = 0;
+    if (box_contains(window, *root, box_frame))
+    {
+        (*root)->working_flag = false;
+        return 0;
+    }
+    // A subtree entirely outside is cut off instead of labeled deleted, unless it is the tree root
+    if (box_outside(window, *root, box_frame) && root != &Root_Node)
+    {
+        tmp_counter = (*root)->TreeSize - (*root)->invalid_point_num;
+        if (detach_subtree(root))
+            return tmp_counter;
+        tmp_counter = 0;
+    }
+    if (!(*root)->point_deleted && !box_contains_point(window, (*root)->point, box_frame))
+    {
+        (*root)->point_deleted = true;
+        tmp_counter += 1;
+    }
+    KD_TREE_NODE **son_links[2] = {&(*root)->left_son_ptr, &(*root)->right_son_ptr};
+    for (KD_TREE_NODE **son_link : son_links)
+    {
+        if ((Rebuild_Ptr == nullptr) || *son_link != *Rebuild_Ptr)
+        {
+            tmp_counter += Delete_outside(son_link, window, allow_rebuild, box_frame);
+        }
+        else
+        {
+            pthread_mutex_lock(&working_flag_mutex);
+            tmp_counter += delete_outside_logged(son_link, window, box_frame);
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+    }
+    Update(*root);
+    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num && !bake_requested)
+        Rebuild_Ptr = nullptr;
+    bool need_rebuild = allow_rebuild & Criterion_Check((*root));
+    if (need_rebuild)
+        Rebuild(root);
+    if ((*root) != nullptr)
+        (*root)->working_flag = false;
+    return tmp_counter;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::delete_outside_logged(KD_TREE_NODE **root, const BoxPointType &window, const KD_TREE_Rigid_Transform *box_frame)
+{
+    // The subtree on the rebuild thread: the outside of the window is deleted as 2 * DIM boxes, which are also logged for
+    // the rebuilt copy. The caller holds working_flag_mutex.
+    if (box_frame != nullptr)
+        return delete_points_logged(root, window, box_frame, false);
+    int tmp_counter = 0;
+    for (int i = 0; i < DIM; i++)
+    {
+        for (int side = 0; side < 2; side++)
+        {
+            Operation_Logger_Type operation{};
+            operation.op = DELETE_BOX;
+            for (int j = 0; j < DIM; j++)
+            {
+                operation.boxpoint.vertex_min[j] = -INFINITY;
+                operation.boxpoint.vertex_max[j] = INFINITY;
+            }
+            if (side == 0)
+                operation.boxpoint.vertex_max[i] = window.vertex_min[i];
+            else
+                operation.boxpoint.vertex_min[i] = window.vertex_max[i];
+            tmp_counter += Delete_by_range(root, operation.boxpoint, false, false);
+            if (rebuild_flag)
+            {
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(operation);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            }
+        }
+    }
+    return tmp_counter;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+int KD_TREE<PointType, DIM, PointStorage>::delete_points_logged(KD_TREE_NODE **root, const BoxPointType &boxpoint, const KD_TREE_Rigid_Transform *box_frame, bool inside)
+{
+    // A box in the map frame can't be logged for the copy on the rebuild thread, the points of the subtree inside
+    // (or outside) it are deleted and logged one by one instead. The caller holds working_flag_mutex.
+    EntryVector points;
+    if (inside)
+        Search_by_range(root, boxpoint, points, box_frame);
+    else
+        flatten_storage(*root, points, NOT_RECORD);
+    int tmp_counter = 0;
+    for (const Point_Entry_Type &entry : points)
+    {
+        if (!inside && box_contains_point(boxpoint, entry.point, box_frame))
+            continue;
+        Delete_by_point(root, entry.point, false);
+        tmp_counter++;
+        if (rebuild_flag)
+        {
+            Operation_Logger_Type operation{};
+            operation.point = entry.point;
+            operation.op = DELETE_POINT;
+            pthread_mutex_lock(&rebuild_logger_mutex_lock);
+            Rebuild_Logger.push(operation);
+            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+        }
+    }
+    return tmp_counter;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::restore_points_logged(KD_TREE_NODE **root, const BoxPointType &boxpoint, const KD_TREE_Rigid_Transform *box_frame)
+{
+    // As delete_points_logged: the points of the subtree inside a box in the map frame are restored, then logged one by one
+    // for the copy on the rebuild thread. The caller holds working_flag_mutex.
+    Add_by_range(root, boxpoint, false, box_frame);
+    if (!rebuild_flag)
+        return;
+    EntryVector points;
+    Search_by_range(root, boxpoint, points, box_frame);
+    for (const Point_Entry_Type &entry : points)
+    {
+        Operation_Logger_Type operation{};
+        operation.point = entry.point;
+        operation.op = RESTORE_POINT;
+        pthread_mutex_lock(&rebuild_logger_mutex_lock);
+        Rebuild_Logger.push(operation);
+        pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+    }
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+bool KD_TREE<PointType, DIM, PointStorage>::detach_subtree(KD_TREE_NODE **root, vector<KD_TREE_NODE *> *Subtrees)
+{
+    // Unlinks the subtree unless it holds the subtree on the rebuild thread. The rebuild thread frees it later and reports
+    // its points through acquire_removed_points. With Subtrees it is handed to the caller instead, which queues it later.
+    pthread_mutex_lock(&working_flag_mutex);
+    bool detach = !contains_rebuild_root(*root);
+    if (detach && Subtrees != nullptr)
+    {
+        Subtrees->push_back(*root);
+        *root = nullptr;
+    }
+    else if (detach)
+    {
+        pthread_mutex_lock(&detached_trees_mutex_lock);
+        Detached_Trees.push_back(make_pair(*root, bake_epoch));
+        pthread_mutex_unlock(&detached_trees_mutex_lock);
+        *root = nullptr;
+    }
+    pthread_mutex_unlock(&working_flag_mutex);
+    return detach;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+bool KD_TREE<PointType, DIM, PointStorage>::contains_rebuild_root(KD_TREE_NODE *root)
+{
+    // Only called with working_flag_mutex held, so the rebuild thread does not swap its subtree in meanwhile
+    if (Rebuild_Ptr == nullptr)
+        return false;
+    for (KD_TREE_NODE *node = *Rebuild_Ptr; node != nullptr; node = node->father_ptr)
+    {
+        if (node == root)
+            return true;
+    }
+    return false;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::free_detached_trees()
+{
+    vector<pair<KD_TREE_NODE *, int>> detached_trees;
+    vector<KD_TREE_NODE *> discarded_trees;
+    pthread_mutex_lock(&detached_trees_mutex_lock);
+    detached_trees.swap(Detached_Trees);
+    discarded_trees.swap(Discarded_Trees);
+    pthread_mutex_unlock(&detached_trees_mutex_lock);
+    // Trees replaced by a rebake hold no removed points
+    for (KD_TREE_NODE *root : discarded_trees)
+        delete_tree_nodes(&root);
+    for (auto &detached_tree : detached_trees)
+    {
+        KD_TREE_NODE *root = detached_tree.first;
+        // All points of the subtree are removed now, except the ones a downsample has already dropped
+        PointVector removed_points;
+        MANUAL_STACK<pair<KD_TREE_NODE *, Pending_Labels>> stack;
+        Node_Labels labels;
+        stack.push(make_pair(root, Pending_Labels()));
+        while (!stack.empty())
+        {
+            pair<KD_TREE_NODE *, Pending_Labels> entry = stack.pop();
+            KD_TREE_NODE *node = entry.first;
+            read_labels(node, entry.second, labels);
+            if (!labels.point_downsample_deleted)
+                removed_points.push_back(decode_point(node->point));
+            if (node->right_son_ptr != nullptr)
+                stack.push(make_pair(node->right_son_ptr, labels.right));
+            if (node->left_son_ptr != nullptr)
+                stack.push(make_pair(node->left_son_ptr, labels.left));
+        }
+        pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);
+        // Cut off before the last rebake was swapped in (which also moved the points reported until then)
+        if (detached_tree.second != bake_epoch)
+        {
+            for (PointType &point : removed_points)
+                transform_point(point, Bake_Transform, false);
+        }
+        Multithread_Points_deleted.insert(Multithread_Points_deleted.end(), removed_points.begin(), removed_points.end());
+        pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
+        delete_tree_nodes(&root);
+    }
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Delete_by_point(KD_TREE_NODE **root, StoredPoint point, bool allow_rebuild)
+{
+    if ((*root) == nullptr || (*root)->tree_deleted)
+        return;
+    own_node(root);
+    (*root)->working_flag = true;
+    Push_Down(*root);
+    if (same_point((*root)->point, point) && !(*root)->point_deleted)
+    {
+        (*root)->point_deleted = true;
+        (*root)->invalid_point_num += 1;
+        if ((*root)->invalid_point_num == (*root)->TreeSize)
+            (*root)->tree_deleted = true;
+        return;
+    }
+    Operation_Logger_Type delete_log{};
+    struct timespec Timeout;
+    delete_log.op = DELETE_POINT;
+    delete_log.point = point;
+    if (point_value(point, (*root)->division_axis) < point_value((*root)->point, (*root)->division_axis))
+    {
+        if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr)
+        {
+            Delete_by_point(&(*root)->left_son_ptr, point, allow_rebuild);
+        }
+        else
+        {
+            pthread_mutex_lock(&working_flag_mutex);
+            Delete_by_point(&(*root)->left_son_ptr, point, false);
+            if (rebuild_flag)
+            {
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(delete_log);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            }
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+    }
+    else
+    {
+        if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr)
+        {
+            Delete_by_point(&(*root)->right_son_ptr, point, allow_rebuild);
+        }
+        else
+        {
+            pthread_mutex_lock(&working_flag_mutex);
+            Delete_by_point(&(*root)->right_son_ptr, point, false);
+            if (rebuild_flag)
+            {
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(delete_log);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            }
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+    }
+    Update(*root);
+    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num && !bake_requested)
+        Rebuild_Ptr = nullptr;
+    bool need_rebuild = allow_rebuild & Criterion_Check((*root));
+    if (need_rebuild)
+        Rebuild(root);
+    if ((*root) != nullptr)
+        (*root)->working_flag = false;
+    return;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+bool KD_TREE<PointType, DIM, PointStorage>::Delete_by_id(KD_TREE_NODE **root, const float *coordinate, uint32_t point_id, bool allow_rebuild)
+{
+    if ((*root) == nullptr || (*root)->tree_deleted)
+        return false;
+    own_node(root);
+    (*root)->working_flag = true;
+    Push_Down(*root);
+    if ((*root)->point_id == point_id && !(*root)->point_deleted)
+    {
+        (*root)->point_deleted = true;
+        (*root)->invalid_point_num += 1;
+        if ((*root)->invalid_point_num == (*root)->TreeSize)
+            (*root)->tree_deleted = true;
+        (*root)->working_flag = false;
+        return true;
+    }
+    Operation_Logger_Type delete_log{};
+    delete_log.op = DELETE_POINT_ID;
+    delete_log.point_id = point_id;
+    memcpy(delete_log.id_coordinate, coordinate, sizeof(delete_log.id_coordinate));
+    float split_value = point_value((*root)->point, (*root)->division_axis);
+    float value = coordinate[(*root)->division_axis];
+    // Points equal to the split value can sit on either side after a rebuild
+    bool found = false;
+    KD_TREE_NODE **son_ptr[2] = {&(*root)->left_son_ptr, &(*root)->right_son_ptr};
+    for (int side = 0; side < 2 && !found; side++)
+    {
+        if ((side == 0 && value > split_value) || (side == 1 && value < split_value))
+            continue;
+        if ((Rebuild_Ptr == nullptr) || *son_ptr[side] != *Rebuild_Ptr)
+        {
+            found = Delete_by_id(son_ptr[side], coordinate, point_id, allow_rebuild);
+        }
+        else
+        {
+            pthread_mutex_lock(&working_flag_mutex);
+            found = Delete_by_id(son_ptr[side], coordinate, point_id, false);
+            if (rebuild_flag && found)
+            {
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(delete_log);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            }
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+    }
+    Update(*root);
+    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num && !bake_requested)
+        Rebuild_Ptr = nullptr;
+    bool need_rebuild = allow_rebuild & Criterion_Check((*root));
+    if (need_rebuild)
+        Rebuild(root);
+    if ((*root) != nullptr)
+        (*root)->working_flag = false;
+    return found;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Add_by_range(KD_TREE_NODE **root, BoxPointType boxpoint, bool allow_rebuild, const KD_TREE_Rigid_Transform *box_frame)
+{
+    if ((*root) == nullptr)
+        return;
+    own_node(root);
+    (*root)->working_flag = true;
+    Push_Down(*root);
+    if (box_outside(boxpoint, (*root), box_frame))
+        return;
+    if (box_contains(boxpoint, (*root), box_frame))
+    {
+        (*root)->tree_deleted = false || (*root)->tree_downsample_deleted;
+        (*root)->point_deleted = false || (*root)->point_downsample_deleted;
+        (*root)->need_push_down_to_left = true;
+        (*root)->need_push_down_to_right = true;
+        (*root)->invalid_point_num = (*root)->down_del_num;
+        return;
+    }
+    if (box_contains_point(boxpoint, (*root)->point, box_frame))
+    {
+        (*root)->point_deleted = (*root)->point_downsample_deleted;
+    }
+    Operation_Logger_Type add_box_log{};
+    struct timespec Timeout;
+    add_box_log.op = ADD_BOX;
+    add_box_log.boxpoint = boxpoint;
+    if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr)
+    {
+        Add_by_range(&((*root)->left_son_ptr), boxpoint, allow_rebuild, box_frame);
+    }
+    else
+    {
+        pthread_mutex_lock(&working_flag_mutex);
+        if (box_frame != nullptr)
+        {
+            restore_points_logged(&((*root)->left_son_ptr), boxpoint, box_frame);
+        }
+        else
+        {
+            Add_by_range(&((*root)->left_son_ptr), boxpoint, false);
+            if (rebuild_flag)
+            {
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(add_box_log);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            }
+        }
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr)
+    {
+        Add_by_range(&((*root)->right_son_ptr), boxpoint, allow_rebuild, box_frame);
+    }
+    else
+    {
+        pthread_mutex_lock(&working_flag_mutex);
+        if (box_frame != nullptr)
+        {
+            restore_points_logged(&((*root)->right_son_ptr), boxpoint, box_frame);
+        }
+        else
+        {
+            Add_by_range(&((*root)->right_son_ptr), boxpoint, false);
+            if (rebuild_flag)
+            {
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(add_box_log);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            }
+        }
+        pthread_mutex_unlock(&working_flag_mutex);
+    }
+    Update(*root);
+    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num && !bake_requested)
+        Rebuild_Ptr = nullptr;
+    bool need_rebuild = allow_rebuild & Criterion_Check((*root));
+    if (need_rebuild)
+        Rebuild(root);
+    if ((*root) != nullptr)
+        (*root)->working_flag = false;
+    return;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Add_by_point(KD_TREE_NODE **root, StoredPoint point, uint32_t point_id, double point_time, bool allow_rebuild, int father_axis)
+{
+    if (*root == nullptr)
+    {
+        *root = new KD_TREE_NODE;
+        InitTreeNode(*root);
+        (*root)->point = point;
+        (*root)->point_id = point_id;
+#if TIMESTAMP_SWITCH
+        (*root)->point_time = point_time;
+#endif
+        (*root)->division_axis = (father_axis + 1) % DIM;
+        Update(*root);
+        return;
+    }
+    own_node(root);
+    (*root)->working_flag = true;
+    Operation_Logger_Type add_log{};
+    struct timespec Timeout;
+    add_log.op = ADD_POINT;
+    add_log.point = point;
+    add_log.point_id = point_id;
+#if TIMESTAMP_SWITCH
+    add_log.point_time = point_time;
+#endif
+    Push_Down(*root);
+    if (point_value(point, (*root)->division_axis) < point_value((*root)->point, (*root)->division_axis))
+    {
+        if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr)
+        {
+            Add_by_point(&(*root)->left_son_ptr, point, point_id, point_time, allow_rebuild, (*root)->division_axis);
+        }
+        else
+        {
+            pthread_mutex_lock(&working_flag_mutex);
+            Add_by_point(&(*root)->left_son_ptr, point, point_id, point_time, false, (*root)->division_axis);
+            if (rebuild_flag)
+            {
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(add_log);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            }
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+    }
+    else
+    {
+        if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr)
+        {
+            Add_by_point(&(*root)->right_son_ptr, point, point_id, point_time, allow_rebuild, (*root)->division_axis);
+        }
+        else
+        {
+            pthread_mutex_lock(&working_flag_mutex);
+            Add_by_point(&(*root)->right_son_ptr, point, point_id, point_time, false, (*root)->division_axis);
+            if (rebuild_flag)
+            {
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(add_log);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            }
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+    }
+    Update(*root);
+    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num && !bake_requested)
+        Rebuild_Ptr = nullptr;
+    bool need_rebuild = allow_rebuild & Criterion_Check((*root));
+    if (need_rebuild)
+        Rebuild(root);
+    if ((*root) != nullptr)
+        (*root)->working_flag = false;
+    return;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Search(KD_TREE_NODE **root, int k_nearest, PointType point, MANUAL_HEAP &q, float max_dist, float prune_scale, int &visit_budget, KD_TREE_NODE *skip_root, double min_time, Pending_Labels labels)
+{
+    // labels: the ones the fathers of root have not pushed down yet
+    MANUAL_STACK<Traversal_Entry> stack;
+    int locked_size = -1;
+    float max_dist_sq = max_dist * max_dist;
+    Node_Labels node_labels;
+    stack.push(Traversal_Entry{root, 0.0f, false, labels});
+    while (!stack.empty() && visit_budget > 0)
+    {
+        leave_subtree(stack.size(), locked_size);
+        Traversal_Entry entry = stack.pop();
+        // The far child is checked again here, the k-th distance may have shrunk since it was pushed
+        if (q.size() >= k_nearest && entry.dist * prune_scale >= q.top().dist)
+            continue;
+        // Walk down the near children, leaving the far ones on the stack
+        KD_TREE_NODE **link = entry.link;
+        Pending_Labels pending = entry.labels;
+        while (link != nullptr && visit_budget > 0)
+        {
+            enter_subtree(link, stack.size(), locked_size);
+            KD_TREE_NODE *node = *link;
+            if (node == nullptr || node == skip_root)
+                break;
+            read_labels(node, pending, node_labels);
+            if (node_labels.tree_deleted)
+                break;
+#if TIMESTAMP_SWITCH
+            if (node->time_range[1] < min_time)
+                break;
+#endif
+            // The box distances of both children are needed below, start loading them while the node itself is checked
+            prefetch_node(node->left_son_ptr);
+            prefetch_node(node->right_son_ptr);
+            visit_budget--;
+#if METRICS_SWITCH
+            search_visited_counter++;
+#endif
+#if TIMESTAMP_SWITCH
+            if (!node_labels.point_deleted && node->point_time >= min_time)
+#else
+            if (!node_labels.point_deleted)
+#endif
+            {
+                float dist = calc_dist(node->point, point);
+                if (dist <= max_dist_sq && (q.size() < k_nearest || dist < q.top().dist))
+                {
+                    if (q.size() >= k_nearest)
+                        q.pop();
+                    PointType_CMP current_point{decode_point(node->point), dist, node->point_id};
+                    q.push(current_point);
+                }
+            }
+            float dist_left_node = calc_box_dist(node->left_son_ptr, point);
+            float dist_right_node = calc_box_dist(node->right_son_ptr, point);
+            Traversal_Entry near_entry{&node->left_son_ptr, dist_left_node, false, node_labels.left};
+            Traversal_Entry far_entry{&node->right_son_ptr, dist_right_node, false, node_labels.right};
+            if (dist_right_node < dist_left_node)
+                swap(near_entry, far_entry);
+            if (*far_entry.link != nullptr && far_entry.dist <= max_dist_sq && (q.size() < k_nearest || far_entry.dist * prune_scale < q.top().dist))
+                stack.push(far_entry);
+            link = nullptr;
+            if (*near_entry.link != nullptr && near_entry.dist <= max_dist_sq && (q.size() < k_nearest || near_entry.dist * prune_scale < q.top().dist))
+            {
+                link = near_entry.link;
+                pending = near_entry.labels;
+                // The near child is visited next, its children one step later
+                prefetch_node((*link)->left_son_ptr);
+                prefetch_node((*link)->right_son_ptr);
+            }
+        }
+    }
+    leave_subtree(0, locked_size);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+template <typename StorageType>
+void KD_TREE<PointType, DIM, PointStorage>::Search_by_range(KD_TREE_NODE **root, BoxPointType boxpoint, StorageType &Storage, const KD_TREE_Rigid_Transform *box_frame, vector<KD_TREE_NODE *> *Subtrees)
+{
+    // With Subtrees, the subtrees inside the box are handed back instead of walked, unless labels are pending for them
+    MANUAL_STACK<Traversal_Entry> stack;
+    int locked_size = -1;
+    Node_Labels labels;
+    stack.push(Traversal_Entry{root, 0.0f, false});
+    while (!stack.empty())
+    {
+        leave_subtree(stack.size(), locked_size);
+        Traversal_Entry entry = stack.pop();
+        // Walk down the left children, leaving the right ones on the stack
+        KD_TREE_NODE **link = entry.link;
+        bool inside = entry.inside;
+        Pending_Labels pending = entry.labels;
+        while (link != nullptr)
+        {
+            enter_subtree(link, stack.size(), locked_size);
+            KD_TREE_NODE *node = *link;
+            if (node == nullptr)
+                break;
+            read_labels(node, pending, labels);
+            if (labels.tree_deleted)
+                break;
+            // Below a node whose range is inside the box every point is taken without further tests
+            if (!inside)
+            {
+                if (box_outside(boxpoint, node, box_frame))
+                    break;
+                inside = box_contains(boxpoint, node, box_frame);
+                if (inside && Subtrees != nullptr && !pending.pushed)
+                {
+                    Subtrees->push_back(node);
+                    break;
+                }
+            }
+            if ((inside || box_contains_point(boxpoint, node->point, box_frame)) && !labels.point_deleted)
+                push_storage(Storage, node);
+            prefetch_node(node->left_son_ptr);
+            prefetch_node(node->right_son_ptr);
+            if (node->right_son_ptr != nullptr)
+                stack.push(Traversal_Entry{&node->right_son_ptr, 0.0f, inside, labels.right});
+            link = node->left_son_ptr != nullptr ? &node->left_son_ptr : nullptr;
+            pending = labels.left;
+        }
+    }
+    leave_subtree(0, locked_size);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+template <typename StorageType>
+void KD_TREE<PointType, DIM, PointStorage>::Search_by_radius(KD_TREE_NODE **root, PointType point, float radius, StorageType &Storage)
+{
+    MANUAL_STACK<Traversal_Entry> stack;
+    int locked_size = -1;
+    Node_Labels labels;
+    stack.push(Traversal_Entry{root, 0.0f, false});
+    while (!stack.empty())
+    {
+        leave_subtree(stack.size(), locked_size);
+        Traversal_Entry entry = stack.pop();
+        KD_TREE_NODE **link = entry.link;
+        bool inside = entry.inside;
+        Pending_Labels pending = entry.labels;
+        while (link != nullptr)
+        {
+            enter_subtree(link, stack.size(), locked_size);
+            KD_TREE_NODE *node = *link;
+            if (node == nullptr)
+                break;
+            read_labels(node, pending, labels);
+            if (labels.tree_deleted)
+                break;
+            if (!inside)
+            {
+                float dist = 0.0f;
+                for (int i = 0; i < DIM; i++)
+                {
+                    float center_offset = (node->node_range[i][0] + node->node_range[i][1]) * 0.5 - Traits::get(point, i);
+                    dist += center_offset * center_offset;
+                }
+                dist = sqrt(dist);
+                if (dist > radius + sqrt(node->radius_sq))
+                    break;
+                inside = dist <= radius - sqrt(node->radius_sq);
+            }
+            if ((inside || calc_dist(node->point, point) <= radius * radius) && !labels.point_deleted)
+                push_storage(Storage, node);
+            prefetch_node(node->left_son_ptr);
+            prefetch_node(node->right_son_ptr);
+            if (node->right_son_ptr != nullptr)
+                stack.push(Traversal_Entry{&node->right_son_ptr, 0.0f, inside, labels.right});
+            link = node->left_son_ptr != nullptr ? &node->left_son_ptr : nullptr;
+            pending = labels.left;
+        }
+    }
+    leave_subtree(0, locked_size);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+bool KD_TREE<PointType, DIM, PointStorage>::Criterion_Check(KD_TREE_NODE *root)
+{
+    if (root->TreeSize <= Minimal_Unbalanced_Tree_Size)
+    {
+        return false;
+    }
+    float balance_evaluation = 0.0f;
+    float delete_evaluation = 0.0f;
+    KD_TREE_NODE *son_ptr = root->left_son_ptr;
+    if (son_ptr == nullptr)
+        son_ptr = root->right_son_ptr;
+    delete_evaluation = float(root->invalid_point_num) / root->TreeSize;
+    balance_evaluation = float(son_ptr->TreeSize) / (root->TreeSize - 1);
+    if (delete_evaluation > delete_criterion_param)
+    {
+        return true;
+    }
+    if (balance_evaluation > balance_criterion_param || balance_evaluation < 1 - balance_criterion_param)
+    {
+        return true;
+    }
+    return false;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Push_Down(KD_TREE_NODE *root)
+{
+    if (root == nullptr)
+        return;
+    Operation_Logger_Type operation{};
+    operation.op = PUSH_DOWN;
+    operation.tree_deleted = root->tree_deleted;
+    operation.tree_downsample_deleted = root->tree_downsample_deleted;
+    if (root->need_push_down_to_left && root->left_son_ptr != nullptr)
+    {
+        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr)
+        {
+            own_node(&root->left_son_ptr);
+            root->left_son_ptr->tree_downsample_deleted |= root->tree_downsample_deleted;
+            root->left_son_ptr->point_downsample_deleted |= root->tree_downsample_deleted;
+            root->left_son_ptr->tree_deleted = root->tree_deleted || root->left_son_ptr->tree_downsample_deleted;
+            root->left_son_ptr->point_deleted = root->left_son_ptr->tree_deleted || root->left_son_ptr->point_downsample_deleted;
+            if (root->tree_downsample_deleted)
+                root->left_son_ptr->down_del_num = root->left_son_ptr->TreeSize;
+            if (root->tree_deleted)
+                root->left_son_ptr->invalid_point_num = root->left_son_ptr->TreeSize;
+            else
+                root->left_son_ptr->invalid_point_num = root->left_son_ptr->down_del_num;
+            root->left_son_ptr->need_push_down_to_left = true;
+            root->left_son_ptr->need_push_down_to_right = true;
+            root->need_push_down_to_left = false;
+        }
+        else
+        {
+            pthread_mutex_lock(&working_flag_mutex);
+            own_node(&root->left_son_ptr);
+            root->left_son_ptr->tree_downsample_deleted |= root->tree_downsample_deleted;
+            root->left_son_ptr->point_downsample_deleted |= root->tree_downsample_deleted;
+            root->left_son_ptr->tree_deleted = root->tree_deleted || root->left_son_ptr->tree_downsample_deleted;
+            root->left_son_ptr->point_deleted = root->left_son_ptr->tree_deleted || root->left_son_ptr->point_downsample_deleted;
+            if (root->tree_downsample_deleted)
+                root->left_son_ptr->down_del_num = root->left_son_ptr->TreeSize;
+            if (root->tree_deleted)
+                root->left_son_ptr->invalid_point_num = root->left_son_ptr->TreeSize;
+            else
+                root->left_son_ptr->invalid_point_num = root->left_son_ptr->down_del_num;
+            root->left_son_ptr->need_push_down_to_left = true;
+            root->left_son_ptr->need_push_down_to_right = true;
+            if (rebuild_flag)
+            {
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(operation);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            }
+            root->need_push_down_to_left = false;
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+    }
+    if (root->need_push_down_to_right && root->right_son_ptr != nullptr)
+    {
+        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr)
+        {
+            own_node(&root->right_son_ptr);
+            root->right_son_ptr->tree_downsample_deleted |= root->tree_downsample_deleted;
+            root->right_son_ptr->point_downsample_deleted |= root->tree_downsample_deleted;
+            root->right_son_ptr->tree_deleted = root->tree_deleted || root->right_son_ptr->tree_downsample_deleted;
+            root->right_son_ptr->point_deleted = root->right_son_ptr->tree_deleted || root->right_son_ptr->point_downsample_deleted;
+            if (root->tree_downsample_deleted)
+                root->right_son_ptr->down_del_num = root->right_son_ptr->TreeSize;
+            if (root->tree_deleted)
+                root->right_son_ptr->invalid_point_num = root->right_son_ptr->TreeSize;
+            else
+                root->right_son_ptr->invalid_point_num = root->right_son_ptr->down_del_num;
+            root->right_son_ptr->need_push_down_to_left = true;
+            root->right_son_ptr->need_push_down_to_right = true;
+            root->need_push_down_to_right = false;
+        }
+        else
+        {
+            pthread_mutex_lock(&working_flag_mutex);
+            own_node(&root->right_son_ptr);
+            root->right_son_ptr->tree_downsample_deleted |= root->tree_downsample_deleted;
+            root->right_son_ptr->point_downsample_deleted |= root->tree_downsample_deleted;
+            root->right_son_ptr->tree_deleted = root->tree_deleted || root->right_son_ptr->tree_downsample_deleted;
+            root->right_son_ptr->point_deleted = root->right_son_ptr->tree_deleted || root->right_son_ptr->point_downsample_deleted;
+            if (root->tree_downsample_deleted)
+                root->right_son_ptr->down_del_num = root->right_son_ptr->TreeSize;
+            if (root->tree_deleted)
+                root->right_son_ptr->invalid_point_num = root->right_son_ptr->TreeSize;
+            else
+                root->right_son_ptr->invalid_point_num = root->right_son_ptr->down_del_num;
+            root->right_son_ptr->need_push_down_to_left = true;
+            root->right_son_ptr->need_push_down_to_right = true;
+            if (rebuild_flag)
+            {
+                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                Rebuild_Logger.push(operation);
+                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            }
+            root->need_push_down_to_right = false;
+            pthread_mutex_unlock(&working_flag_mutex);
+        }
+    }
+    return;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Update(KD_TREE_NODE *root)
+{
+    KD_TREE_NODE *left_son_ptr = root->left_son_ptr;
+    KD_TREE_NODE *right_son_ptr = root->right_son_ptr;
+    // Update Tree Size
+    if (left_son_ptr != nullptr && right_son_ptr != nullptr)
+    {
+        root->TreeSize = left_son_ptr->TreeSize + right_son_ptr->TreeSize + 1;
+        root->invalid_point_num = left_son_ptr->invalid_point_num + right_son_ptr->invalid_point_num + (root->point_deleted ? 1 : 0);
+        root->down_del_num = left_son_ptr->down_del_num + right_son_ptr->down_del_num + (root->point_downsample_deleted ? 1 : 0);
+        root->tree_downsample_deleted = left_son_ptr->tree_downsample_deleted & right_son_ptr->tree_downsample_deleted & root->point_downsample_deleted;
+        root->tree_deleted = left_son_ptr->tree_deleted && right_son_ptr->tree_deleted && root->point_deleted;
+    }
+    else if (left_son_ptr != nullptr)
+    {
+        root->TreeSize = left_son_ptr->TreeSize + 1;
+        root->invalid_point_num = left_son_ptr->invalid_point_num + (root->point_deleted ? 1 : 0);
+        root->down_del_num = left_son_ptr->down_del_num + (root->point_downsample_deleted ? 1 : 0);
+        root->tree_downsample_deleted = left_son_ptr->tree_downsample_deleted & root->point_downsample_deleted;
+        root->tree_deleted = left_son_ptr->tree_deleted && root->point_deleted;
+    }
+    else if (right_son_ptr != nullptr)
+    {
+        root->TreeSize = right_son_ptr->TreeSize + 1;
+        root->invalid_point_num = right_son_ptr->invalid_point_num + (root->point_deleted ? 1 : 0);
+        root->down_del_num = right_son_ptr->down_del_num + (root->point_downsample_deleted ? 1 : 0);
+        root->tree_downsample_deleted = right_son_ptr->tree_downsample_deleted & root->point_downsample_deleted;
+        root->tree_deleted = right_son_ptr->tree_deleted && root->point_deleted;
+    }
+    else
+    {
+        root->TreeSize = 1;
+        root->invalid_point_num = (root->point_deleted ? 1 : 0);
+        root->down_del_num = (root->point_downsample_deleted ? 1 : 0);
+        root->tree_downsample_deleted = root->point_downsample_deleted;
+        root->tree_deleted = root->point_deleted;
+    }
+    // The range covers the valid points, or all points once the whole subtree is deleted
+    bool range_left = left_son_ptr != nullptr && (root->tree_deleted || !left_son_ptr->tree_deleted);
+    bool range_right = right_son_ptr != nullptr && (root->tree_deleted || !right_son_ptr->tree_deleted);
+    bool range_point = root->tree_deleted || !root->point_deleted;
+    float radius_sq = 0.0f;
+    for (int i = 0; i < DIM; i++)
+    {
+        float range_min = INFINITY, range_max = -INFINITY;
+        if (range_left)
+        {
+            range_min = min(range_min, left_son_ptr->node_range[i][0]);
+            range_max = max(range_max, left_son_ptr->node_range[i][1]);
+        }
+        if (range_right)
+        {
+            range_min = min(range_min, right_son_ptr->node_range[i][0]);
+            range_max = max(range_max, right_son_ptr->node_range[i][1]);
+        }
+        if (range_point)
+        {
+            range_min = min(range_min, point_value(root->point, i));
+            range_max = max(range_max, point_value(root->point, i));
+        }
+        root->node_range[i][0] = range_min;
+        root->node_range[i][1] = range_max;
+        float half_length = (range_max - range_min) * 0.5;
+        radius_sq += half_length * half_length;
+    }
+    root->radius_sq = radius_sq;
+#if TIMESTAMP_SWITCH
+    root->time_range[0] = range_point ? root->point_time : INFINITY;
+    root->time_range[1] = range_point ? root->point_time : -INFINITY;
+    if (range_left)
+    {
+        root->time_range[0] = min(root->time_range[0], left_son_ptr->time_range[0]);
+        root->time_range[1] = max(root->time_range[1], left_son_ptr->time_range[1]);
+    }
+    if (range_right)
+    {
+        root->time_range[0] = min(root->time_range[0], right_son_ptr->time_range[0]);
+        root->time_range[1] = max(root->time_range[1], right_son_ptr->time_range[1]);
+    }
+#endif
+#if MOMENTS_SWITCH
+    update_moments(root);
+#endif
+    if (left_son_ptr != nullptr)
+        left_son_ptr->father_ptr = root;
+    if (right_son_ptr != nullptr)
+        right_son_ptr->father_ptr = root;
+    if (root == Root_Node && root->TreeSize > 3)
+    {
+        KD_TREE_NODE *son_ptr = root->left_son_ptr;
+        if (son_ptr == nullptr)
+            son_ptr = root->right_son_ptr;
+        float tmp_bal = float(son_ptr->TreeSize) / (root->TreeSize - 1);
+        root->alpha_del = float(root->invalid_point_num) / root->TreeSize;
+        root->alpha_bal = (tmp_bal >= 0.5 - EPSS) ? tmp_bal : 1 - tmp_bal;
+    }
+    return;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::update_moments(KD_TREE_NODE *root)
+{
+#if MOMENTS_SWITCH
+    // Start from the node's own point and merge in the sons with the pairwise update of Chan et al.,
+    // which stays accurate far from the origin
+    float mean[3], scatter[6] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+    for (int i = 0; i < 3; i++)
+        mean[i] = i < DIM ? point_value(root->point, i) : 0.0f;
+    int num = 1;
+    KD_TREE_NODE *sons[2] = {root->left_son_ptr, root->right_son_ptr};
+    for (KD_TREE_NODE *son : sons)
+    {
+        if (son == nullptr)
+            continue;
+        int total = num + son->TreeSize;
+        float delta[3];
+        for (int i = 0; i < 3; i++)
+            delta[i] = son->moment_mean[i] - mean[i];
+        float weight = float(num) * son->TreeSize / total;
+        int index = 0;
+        for (int i = 0; i < 3; i++)
+        {
+            for (int j = i; j < 3; j++, index++)
+                scatter[index] += son->moment_scatter[index] + delta[i] * delta[j] * weight;
+        }
+        for (int i = 0; i < 3; i++)
+            mean[i] += delta[i] * son->TreeSize / total;
+        num = total;
+    }
+    memcpy(root->moment_mean, mean, sizeof(mean));
+    memcpy(root->moment_scatter, scatter, sizeof(scatter));
+#endif
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+bool KD_TREE<PointType, DIM, PointStorage>::Plane_Lookup(PointType point, int min_points, Plane_Fit &plane, float max_residual, float max_radius)
+{
+    if (min_points <= 0)
+    {
+        plane = Plane_Fit();
+        return false;
+    }
+    Snapshot_Ptr published;
+    if (KD_TREE *view = published_view(published))
+        return view->Plane_Lookup(point, min_points, plane, max_residual, max_radius);
+    static_assert(DIM >= 3, "Plane fitting needs a 3D tree");
+    point = to_stored(point);
+#if MOMENTS_SWITCH
+    // Follow the division planes down to the smallest subtree holding the query with at least min_points points
+    int locked_size = -1;
+    KD_TREE_NODE **link = &Root_Node;
+    KD_TREE_NODE *patch = nullptr;
+    Pending_Labels pending;
+    Node_Labels labels;
+    int patch_invalid_num = 0;
+    while (true)
+    {
+        enter_subtree(link, 0, locked_size);
+        KD_TREE_NODE *node = *link;
+        if (node == nullptr || node->TreeSize < min_points)
+            break;
+        patch = node;
+        read_labels(node, pending, labels);
+        patch_invalid_num = labels.invalid_point_num;
+        bool go_left = Traits::get(point, node->division_axis) < point_value(node->point, node->division_axis);
+        link = go_left ? &node->left_son_ptr : &node->right_son_ptr;
+        pending = go_left ? labels.left : labels.right;
+    }
+    // Deleted points are still in the moments, so a subtree with any of them can't be used. Its fathers have them too.
+    bool cached = patch != nullptr && patch_invalid_num == 0 && patch->radius_sq <= max_radius * max_radius;
+    if (cached)
+    {
+        Eigen::Matrix3f covariance;
+        int index = 0;
+        for (int i = 0; i < 3; i++)
+        {
+            for (int j = i; j < 3; j++, index++)
+                covariance(i, j) = covariance(j, i) = patch->moment_scatter[index] / patch->TreeSize;
+        }
+        Eigen::Vector3f mean(patch->moment_mean[0], patch->moment_mean[1], patch->moment_mean[2]);
+        plane.num = patch->TreeSize;
+        leave_subtree(0, locked_size);
+        Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> solver;
+        solver.computeDirect(covariance);
+        Eigen::Vector3f normal = solver.eigenvectors().col(0).normalized();
+        for (int i = 0; i < 3; i++)
+            plane.normal[i] = normal[i];
+        plane.d = -normal.dot(mean);
+        plane.residual = sqrt(max(solver.eigenvalues()[0], 0.0f));
+        plane.valid = plane.residual <= max_residual;
+        to_map(plane);
+        return plane.valid;
+    }
+    leave_subtree(0, locked_size);
+#endif
+    MANUAL_HEAP q(2 * min_points);
+    Search_Root(point, min_points, q, max_radius, 0.0f, 0);
+    fit_plane(q, min_points, point, max_residual, plane);
+    to_map(plane);
+    return plane.valid;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::flatten(KD_TREE_NODE *root, PointVector &Storage, delete_point_storage_set storage_type)
+{
+    size_t begin = Storage.size();
+    flatten_storage(root, Storage, storage_type);
+    to_map(Storage, begin);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::push_storage(PointVector &Storage, KD_TREE_NODE *node)
+{
+    Storage.push_back(decode_point(node->point));
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::push_storage(EntryVector &Storage, KD_TREE_NODE *node)
+{
+    Point_Entry_Type entry;
+    entry.point = node->point;
+    entry.point_id = node->point_id;
+#if TIMESTAMP_SWITCH
+    entry.point_time = node->point_time;
+#endif
+    Storage.push_back(entry);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::push_storage(vector<uint32_t> &Storage, KD_TREE_NODE *node)
+{
+    Storage.push_back(node->point_id);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+template <typename StorageType>
+void KD_TREE<PointType, DIM, PointStorage>::flatten_storage(KD_TREE_NODE *root, StorageType &Storage, delete_point_storage_set storage_type)
+{
+    if (root == nullptr)
+        return;
+    MANUAL_STACK<pair<KD_TREE_NODE *, Pending_Labels>> stack;
+    Node_Labels labels;
+    stack.push(make_pair(root, Pending_Labels()));
+    while (!stack.empty())
+    {
+        pair<KD_TREE_NODE *, Pending_Labels> entry = stack.pop();
+        KD_TREE_NODE *node = entry.first;
+        read_labels(node, entry.second, labels);
+        if (!labels.point_deleted)
+        {
+            push_storage(Storage, node);
+        }
+        switch (storage_type)
+        {
+        case NOT_RECORD:
+            break;
+        case DELETE_POINTS_REC:
+            if (labels.point_deleted && !labels.point_downsample_deleted)
+            {
+                Points_deleted.push_back(decode_point(node->point));
+            }
+            break;
+        case MULTI_THREAD_REC:
+            if (labels.point_deleted && !labels.point_downsample_deleted)
+            {
+                Multithread_Points_deleted.push_back(decode_point(node->point));
+            }
+            break;
+        default:
+            break;
+        }
+        if (node->right_son_ptr != nullptr)
+            stack.push(make_pair(node->right_son_ptr, labels.right));
+        if (node->left_son_ptr != nullptr)
+            stack.push(make_pair(node->left_son_ptr, labels.left));
+    }
+    return;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::delete_tree_nodes(KD_TREE_NODE **root)
+{
+    if (*root == nullptr)
+        return;
+    // The subtree is detached and about to be freed, pending push-downs need not be applied. Nodes a snapshot can reach
+    // are retired instead.
+    MANUAL_STACK<KD_TREE_NODE *> stack;
+    stack.push(*root);
+    *root = nullptr;
+    pthread_mutex_lock(&snapshots->mutex_lock);
+    while (!stack.empty())
+    {
+        KD_TREE_NODE *node = stack.pop();
+        if (node->left_son_ptr != nullptr)
+            stack.push(node->left_son_ptr);
+        if (node->right_son_ptr != nullptr)
+            stack.push(node->right_son_ptr);
+        if (shared_node(node))
+            snapshots->retired.push_back(node);
+        else
+            free_node(node);
+    }
+    pthread_mutex_unlock(&snapshots->mutex_lock);
+    return;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::free_node(KD_TREE_NODE *node)
+{
+    Node_Block *block = node->block;
+    if (block == nullptr)
+    {
+        delete node;
+        return;
+    }
+    // Nodes of one block can be freed from both threads, by the in-place and by the background rebuild
+    if (block->live_num.fetch_sub(1) == 1)
+    {
+        delete[] block->nodes;
+        delete block;
+    }
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+typename KD_TREE<PointType, DIM, PointStorage>::Snapshot_Ptr KD_TREE<PointType, DIM, PointStorage>::Snapshot()
+{
+    // Under working_flag_mutex, so that the rebuild thread swaps its subtree in either before or after. Nodes created from
+    // now on have a newer generation than the snapshot.
+    Writer_Guard writer_guard(this);
+    pthread_mutex_lock(&working_flag_mutex);
+    uint32_t snapshot = snapshots->acquire();
+    Snapshot_Ptr snapshot_ptr(new Tree_Snapshot(new KD_TREE(*this, snapshot)));
+    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr != nullptr && (*Rebuild_Ptr)->father_ptr != STATIC_ROOT_NODE)
+    {
+        // The rebuild thread writes the father of its subtree and updates the nodes above, the tree gets copies of them
+        // while the snapshot keeps the originals
+        vector<KD_TREE_NODE *> path;
+        for (KD_TREE_NODE *node = (*Rebuild_Ptr)->father_ptr; node != STATIC_ROOT_NODE; node = node->father_ptr)
+            path.push_back(node);
+        for (int i = int(path.size()) - 1; i >= 0; i--)
+        {
+            KD_TREE_NODE *father_ptr = path[i]->father_ptr;
+            clone_node(father_ptr == STATIC_ROOT_NODE ? &Root_Node : (father_ptr->left_son_ptr == path[i] ? &father_ptr->left_son_ptr : &father_ptr->right_son_ptr));
+        }
+    }
+    pthread_mutex_unlock(&working_flag_mutex);
+    return snapshot_ptr;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Set_Concurrent_Readers(bool enable)
+{
+    Writer_Guard writer_guard(this);
+    pthread_mutex_lock(&published_mutex_lock);
+    writer_thread = pthread_self();
+    pthread_mutex_unlock(&published_mutex_lock);
+    concurrent_readers = enable;
+    if (enable)
+    {
+        publish();
+        return;
+    }
+    pthread_mutex_lock(&published_mutex_lock);
+    Published.reset();
+    pthread_mutex_unlock(&published_mutex_lock);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::publish()
+{
+    // The previous snapshot is released here unless a reader still searches it, then by the last such reader
+    Snapshot_Ptr snapshot = Snapshot();
+    pthread_mutex_lock(&published_mutex_lock);
+    Published.swap(snapshot);
+    pthread_mutex_unlock(&published_mutex_lock);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+KD_TREE<PointType, DIM, PointStorage> *KD_TREE<PointType, DIM, PointStorage>::published_view(Snapshot_Ptr &published)
+{
+    if (!concurrent_readers)
+        return nullptr;
+    // writer_thread changes when the ingestion thread takes over
+    pthread_mutex_lock(&published_mutex_lock);
+    if (!pthread_equal(pthread_self(), writer_thread))
+        published = Published;
+    pthread_mutex_unlock(&published_mutex_lock);
+    return published ? published->view.get() : nullptr;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+uint64_t KD_TREE<PointType, DIM, PointStorage>::Enqueue_Points(PointVector &PointToAdd, bool downsample_on)
+{
+    return enqueue_points(PointToAdd, downsample_on, INFINITY);
+}
+
+#if TIMESTAMP_SWITCH
+template <typename PointType, int DIM, typename PointStorage>
+uint64_t KD_TREE<PointType, DIM, PointStorage>::Enqueue_Points(PointVector &PointToAdd, bool downsample_on, double timestamp)
+{
+    return enqueue_points(PointToAdd, downsample_on, timestamp);
+}
+#endif
+
+template <typename PointType, int DIM, typename PointStorage>
+uint64_t KD_TREE<PointType, DIM, PointStorage>::enqueue_points(PointVector &PointToAdd, bool downsample_on, double timestamp)
+{
+    pthread_mutex_lock(&ingestion_mutex_lock);
+    if (ingestion_thread == 0)
+        start_ingestion();
+    while (Ingestion_Queue.size() >= Ingestion_Queue_Capacity)
+        pthread_cond_wait(&ingestion_space_cond, &ingestion_mutex_lock);
+    Ingestion_Queue.push_back(Ingestion_Batch{PointToAdd, downsample_on, timestamp});
+    uint64_t sequence = ++ingestion_enqueued;
+    pthread_cond_signal(&ingestion_queued_cond);
+    pthread_mutex_unlock(&ingestion_mutex_lock);
+    return sequence;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Wait_For(uint64_t sequence)
+{
+    pthread_mutex_lock(&ingestion_mutex_lock);
+    while (ingestion_applied < sequence)
+        pthread_cond_wait(&ingestion_applied_cond, &ingestion_mutex_lock);
+    pthread_mutex_unlock(&ingestion_mutex_lock);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::Flush()
+{
+    pthread_mutex_lock(&ingestion_mutex_lock);
+    uint64_t sequence = ingestion_enqueued;
+    pthread_mutex_unlock(&ingestion_mutex_lock);
+    Wait_For(sequence);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::start_ingestion()
+{
+    // Under ingestion_mutex_lock, the ingestion thread waits for it before its first update
+    pthread_create(&ingestion_thread, NULL, ingestion_ptr, (void *)this);
+    Writer_Guard writer_guard(this);
+    pthread_mutex_lock(&published_mutex_lock);
+    writer_thread = ingestion_thread;
+    pthread_mutex_unlock(&published_mutex_lock);
+    if (!concurrent_readers)
+    {
+        publish();
+        concurrent_readers = true;
+    }
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::stop_ingestion()
+{
+    // The batches still queued are applied first
+    pthread_mutex_lock(&ingestion_mutex_lock);
+    ingestion_termination_flag = true;
+    pthread_cond_signal(&ingestion_queued_cond);
+    pthread_mutex_unlock(&ingestion_mutex_lock);
+    if (ingestion_thread)
+        pthread_join(ingestion_thread, NULL);
+    ingestion_thread = 0;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void *KD_TREE<PointType, DIM, PointStorage>::ingestion_ptr(void *arg)
+{
+    KD_TREE *handle = (KD_TREE *)arg;
+    handle->ingestion_loop();
+    return nullptr;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::ingestion_loop()
+{
+    vector<Ingestion_Batch> batches;
+    while (true)
+    {
+        pthread_mutex_lock(&ingestion_mutex_lock);
+        while (Ingestion_Queue.empty() && !ingestion_termination_flag)
+            pthread_cond_wait(&ingestion_queued_cond, &ingestion_mutex_lock);
+        if (Ingestion_Queue.empty())
+        {
+            pthread_mutex_unlock(&ingestion_mutex_lock);
+            break;
+        }
+        batches.swap(Ingestion_Queue);
+        uint64_t sequence = ingestion_enqueued;
+        pthread_cond_broadcast(&ingestion_space_cond);
+        pthread_mutex_unlock(&ingestion_mutex_lock);
+        {
+            // One snapshot is published for all the batches
+            Publish_Guard publish_guard(this);
+            for (Ingestion_Batch &batch : batches)
+            {
+                vector<uint32_t> Point_IDs;
+                add_points(batch.points, batch.downsample_on, Point_IDs, batch.timestamp);
+            }
+        }
+        batches.clear();
+        pthread_mutex_lock(&ingestion_mutex_lock);
+        ingestion_applied = sequence;
+        pthread_cond_broadcast(&ingestion_applied_cond);
+        pthread_mutex_unlock(&ingestion_mutex_lock);
+    }
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::own_node(KD_TREE_NODE **link)
+{
+    // The copy the rebuild thread replays the log onto is not linked in, no snapshot reaches it
+    KD_TREE_NODE *node = *link;
+    if (node == nullptr || !shared_node(node) || pthread_equal(pthread_self(), rebuild_thread))
+        return;
+    if (Rebuild_Ptr != nullptr && (Rebuild_Ptr == &node->left_son_ptr || Rebuild_Ptr == &node->right_son_ptr))
+    {
+        pthread_mutex_lock(&working_flag_mutex);
+        clone_node(link);
+        pthread_mutex_unlock(&working_flag_mutex);
+        return;
+    }
+    clone_node(link);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::clone_node(KD_TREE_NODE **link)
+{
+    KD_TREE_NODE *node = *link;
+    KD_TREE_NODE *copy = new KD_TREE_NODE(*node);
+    copy->block = nullptr;
+    copy->generation = snapshots->generation.load(memory_order_relaxed);
+    if (copy->left_son_ptr != nullptr)
+        copy->left_son_ptr->father_ptr = copy;
+    if (copy->right_son_ptr != nullptr)
+        copy->right_son_ptr->father_ptr = copy;
+    if (Rebuild_Ptr == &node->left_son_ptr)
+        Rebuild_Ptr = &copy->left_son_ptr;
+    else if (Rebuild_Ptr == &node->right_son_ptr)
+        Rebuild_Ptr = &copy->right_son_ptr;
+    *link = copy;
+    if (Root_Node == node)
+        Root_Node = copy;
+    if (STATIC_ROOT_NODE != nullptr && STATIC_ROOT_NODE->left_son_ptr == node)
+        STATIC_ROOT_NODE->left_son_ptr = copy;
+    pthread_mutex_lock(&snapshots->mutex_lock);
+    if (shared_node(node))
+        snapshots->retired.push_back(node);
+    else
+        free_node(node);
+    pthread_mutex_unlock(&snapshots->mutex_lock);
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+bool KD_TREE<PointType, DIM, PointStorage>::same_point(const StoredPoint &a, const StoredPoint &b)
+{
+    for (int i = 0; i < DIM; i++)
+        if (fabs(point_value(a, i) - point_value(b, i)) >= EPSS)
+            return false;
+    return true;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+float KD_TREE<PointType, DIM, PointStorage>::calc_dist(const StoredPoint &a, const PointType &b)
+{
+    float dist = 0.0f;
+    for (int i = 0; i < DIM; i++)
+    {
+        float d = point_value(a, i) - Traits::get(b, i);
+        dist += d * d;
+    }
+    return dist;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+float KD_TREE<PointType, DIM, PointStorage>::calc_box_dist(KD_TREE_NODE *node, PointType point)
+{
+    if (node == nullptr)
+        return INFINITY;
+    float min_dist = 0.0;
+    for (int i = 0; i < DIM; i++)
+    {
+        float value = Traits::get(point, i);
+        if (value < node->node_range[i][0])
+            min_dist += (value - node->node_range[i][0]) * (value - node->node_range[i][0]);
+        if (value > node->node_range[i][1])
+            min_dist += (value - node->node_range[i][1]) * (value - node->node_range[i][1]);
+    }
+    return min_dist;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+void KD_TREE<PointType, DIM, PointStorage>::frame_range(const float range[][2], const KD_TREE_Rigid_Transform &frame, float frame_range[][2])
+{
+    // Bounding box in the other frame of the range's first three axes, from its center and half lengths
+    float center[3], half_length[3], frame_center[3];
+    for (int i = 0; i < 3; i++)
+    {
+        center[i] = i < DIM ? (range[i][0] + range[i][1]) * 0.5f : 0.0f;
+        half_length[i] = i < DIM ? (range[i][1] - range[i][0]) * 0.5f : 0.0f;
+    }
+    frame.apply(center, frame_center);
+    for (int i = 0; i < 3 && i < DIM; i++)
+    {
+        float frame_half = fabsf(frame.rotation[i][0]) * half_length[0] + fabsf(frame.rotation[i][1]) * half_length[1] + fabsf(frame.rotation[i][2]) * half_length[2];
+        frame_range[i][0] = frame_center[i] - frame_half;
+        frame_range[i][1] = frame_center[i] + frame_half;
+    }
+    for (int i = 3; i < DIM; i++)
+    {
+        frame_range[i][0] = range[i][0];
+        frame_range[i][1] = range[i][1];
+    }
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+bool KD_TREE<PointType, DIM, PointStorage>::box_outside(const BoxPointType &boxpoint, const KD_TREE_NODE *node, const KD_TREE_Rigid_Transform *box_frame)
+{
+    // In another frame the tests use the bounding box of the node's range there, they may miss that a node is outside or
+    // inside, which only costs visiting it
+    float transformed_range[DIM][2];
+    const float(*range)[2] = node->node_range;
+    if (box_frame != nullptr)
+    {
+        frame_range(node->node_range, *box_frame, transformed_range);
+        range = transformed_range;
+    }
+    for (int i = 0; i < DIM; i++)
+        if (boxpoint.vertex_max[i] <= range[i][0] || boxpoint.vertex_min[i] > range[i][1])
+            return true;
+    return false;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+bool KD_TREE<PointType, DIM, PointStorage>::box_contains(const BoxPointType &boxpoint, const KD_TREE_NODE *node, const KD_TREE_Rigid_Transform *box_frame)
+{
+    float transformed_range[DIM][2];
+    const float(*range)[2] = node->node_range;
+    if (box_frame != nullptr)
+    {
+        frame_range(node->node_range, *box_frame, transformed_range);
+        range = transformed_range;
+    }
+    for (int i = 0; i < DIM; i++)
+        if (boxpoint.vertex_min[i] > range[i][0] || boxpoint.vertex_max[i] <= range[i][1])
+            return false;
+    return true;
+}
+
+template <typename PointType, int DIM, typename PointStorage>
+bool KD_TREE<PointType, DIM, PointStorage>::box_contains_point(const BoxPointType &boxpoint, const StoredPoint &point, const KD_TREE_Rigid_Transform *box_frame)
+{
+    float value[DIM];
+    for (int i = 0; i < DIM; i++)
+        value[i] = point_value(point, i);
+    if (box_frame != nullptr)
+    {
+        float stored_value[3] = {value[0], DIM > 1 ? value[1] : 0.0f, DIM > 2 ? value[2] : 0.0f};
+        float frame_value[3];
+        box_frame->apply(stored_value, frame_value);
+        for (int i = 0; i < 3 && i < DIM; i++)
+            value[i] = frame_value[i];
+    }
+    for (int i = 0; i < DIM; i++)
+        if (boxpoint.vertex_min[i] > value[i] || boxpoint.vertex_max[i] <= value[i])
+            return false;
+    return true;
+}
+
+// Manual heap
+
+
+
+// manual queue